@@ -7,4 +7,8 @@
 #define BITSET(a, b) ((a)[BITSLOT(b)] |= BITMASK(b))
 #define BITCLEAR(a, b) ((a)[BITSLOT(b)] &= ~BITMASK(b))
 #define BITTEST(a, b) ((a)[BITSLOT(b)] & BITMASK(b))
-#define BITNSLOTS(nb) ((nb + CHAR_BIT - 1) / CHAR_BIT)
\ No newline at end of file
+#define BITNSLOTS(nb) ((nb + CHAR_BIT - 1) / CHAR_BIT)
+
+// for bitfields shared between threads
+#define BITSET_ATOMIC(a, b) __atomic_fetch_or(&(a)[BITSLOT(b)], BITMASK(b), __ATOMIC_RELEASE)
+#define BITTEST_ATOMIC(a, b) (__atomic_load_n(&(a)[BITSLOT(b)], __ATOMIC_ACQUIRE) & BITMASK(b))
\ No newline at end of file
@@ -0,0 +1,200 @@
+#ifndef pqvm_numa_allocator_h
+#define pqvm_numa_allocator_h
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <string>
+#include <unistd.h>
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+#include <tbb/partitioner.h>
+#include <tbb/task_arena.h>
+#include "pages.h"
+#include "vector.h"
+
+#ifdef HAVE_NUMA
+#include <numa.h>
+#endif
+
+/**
+ * NUMA placement of large buffers.
+ * Linux places a page on the node of the thread that first writes it, so a
+ * register written by a single thread ends up on one node, and on a
+ * multi-socket machine half of the threads read it remotely. The placement
+ * policies:
+ *
+ *     none        leave it to the first writer (the default)
+ *     interleave  spread the pages round robin over all nodes (libnuma)
+ *     touch       first touch every page in parallel, split the way the
+ *                 parallel loops split the register
+ *
+ * With touch, the loops of the blocks backend cut a register in chunks, and
+ * hand them out with a static partitioner: a range of the same length is
+ * cut the same way on every call, and the pages are touched chunk by chunk
+ * the same way, so a thread keeps working on the pages it touched, gate
+ * after gate.
+ * Without libnuma (or on a kernel without NUMA support) interleave falls
+ * back to touch, which needs no support at all; on a single node both are
+ * harmless.
+ */
+
+namespace numa {
+
+    enum policy { none, interleave, touch };
+
+    inline policy& placement () {
+        static policy p = none;
+        return p;
+    }
+
+    inline bool available () {
+#ifdef HAVE_NUMA
+        return numa_available() >= 0;
+#else
+        return false;
+#endif
+    }
+
+    inline int nodes () {
+#ifdef HAVE_NUMA
+        if (available())
+            return numa_num_configured_nodes();
+#endif
+        return 1;
+    }
+
+    /*
+     * Select a policy by name, false for an unknown name. An interleave
+     * request without NUMA support selects touch.
+     */
+    inline bool select (const std::string& name) {
+        if (name == "none")
+            placement() = none;
+        else if (name == "interleave")
+            placement() = available() ? interleave : touch;
+        else if (name == "touch")
+            placement() = touch;
+        else
+            return false;
+        return true;
+    }
+
+    inline const char* name () {
+        switch (placement()) {
+        case interleave:
+            return "interleave";
+        case touch:
+            return "touch";
+        default:
+            return "none";
+        }
+    }
+
+    /*
+     * Do the parallel loops partition statically?
+     */
+    inline bool partitioned () {
+        return placement() == touch;
+    }
+
+    /*
+     * The number of chunks of a range of length elements, with at least
+     * grain elements per chunk: a power of two, up to four per thread. A
+     * register is cut in as many chunks whatever the size of its elements
+     * (amplitudes in the loops, bytes in the first touch).
+     */
+    inline size_t chunks (const size_t length, const size_t grain) {
+        size_t threads = tbb::this_task_arena::max_concurrency(),
+               c = 1;
+        while (c < 4 * threads && length / (2 * c) >= grain)
+            c *= 2;
+        return c;
+    }
+
+}
+
+/**
+ * Allocator placing buffers of min_bytes or more with the NUMA policy.
+ * These are mapped directly (see pages.h), in whole huge pages, and not
+ * yet touched; smaller buffers come from an aligned_allocator. Stateless,
+ * like pool_allocator. Mappings start on a page, so every buffer is
+ * aligned to Alignment bytes.
+ */
+
+template <class T, std::size_t Alignment = PQVM_ALIGNMENT>
+class numa_allocator {
+public:
+    typedef T value_type;
+    typedef aligned_allocator<T, Alignment> base_type;
+    typedef typename base_type::size_type size_type;
+    typedef typename base_type::difference_type difference_type;
+    typedef typename base_type::pointer pointer;
+    typedef typename base_type::const_pointer const_pointer;
+
+    static const size_type min_bytes = pages::huge_size;
+    static const size_type alignment = Alignment;
+
+private:
+    struct first_touch {
+        char* base;
+        size_type bytes, chunk, page;
+
+        void operator() (const tbb::blocked_range<size_type>& c) const {
+            //every page of the chunks, up to the end of the buffer
+            size_type end = c.end() * chunk < bytes ? c.end() * chunk : bytes;
+            for (size_type i = c.begin() * chunk; i < end; i += page)
+                base[i] = 0;
+        }
+    };
+
+    static inline size_type page () {
+        static const size_type p = sysconf(_SC_PAGESIZE);
+        return p;
+    }
+
+    static inline size_type mapped (const size_type bytes) {
+        return (bytes + pages::huge_size - 1) / pages::huge_size * pages::huge_size;
+    }
+
+public:
+    inline pointer allocate (const size_type n) {
+        size_type bytes = n * sizeof(T);
+        if (bytes < min_bytes)
+            return base_type().allocate(n);
+
+        bytes = mapped(bytes);
+        void* p = pages::map(bytes);
+        if (p == NULL)
+            throw std::bad_alloc ();
+
+        switch (numa::placement()) {
+        case numa::interleave:
+#ifdef HAVE_NUMA
+            numa_interleave_memory(p, bytes, numa_all_nodes_ptr);
+#endif
+            break;
+        case numa::touch: {
+            //each thread touches the part the loops will give it
+            const size_type step = pages::huge() ? pages::huge_size : page(),
+                            c = numa::chunks(bytes, step);
+            first_touch body = { (char*)p, bytes, (bytes / c + step - 1) / step * step, step };
+            tbb::parallel_for (tbb::blocked_range<size_type> (0, c, 1), body, tbb::static_partitioner());
+            break;
+        }
+        default:
+            break;
+        }
+        return (pointer)p;
+    }
+
+    inline void deallocate (pointer p, const size_type n) {
+        size_type bytes = n * sizeof(T);
+        if (bytes < min_bytes)
+            base_type().deallocate(p, n);
+        else
+            pages::unmap(p, mapped(bytes));
+    }
+};
+
+#endif
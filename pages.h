@@ -0,0 +1,116 @@
+#ifndef pqvm_pages_h
+#define pqvm_pages_h
+
+#include <atomic>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/**
+ * Page mappings for large buffers.
+ * A register of 2^20 amplitudes or more spans thousands of 4KiB pages, and
+ * every pass over it misses the TLB once per page. With huge pages on, a
+ * buffer is mapped on 2MiB pages, in order of preference:
+ *
+ *     hugetlb      MAP_HUGETLB, from the pages the administrator reserved
+ *                  (/proc/sys/vm/nr_hugepages)
+ *     transparent  a 2MiB aligned mapping with madvise(MADV_HUGEPAGE), the
+ *                  kernel backs it with huge pages where it can
+ *     small        4KiB pages, when neither is available
+ *
+ * The allocators only map multiples of huge_size here (their size classes
+ * are powers of two of at least huge_size), so a buffer is unmapped the
+ * same way whatever backs it. Each mapping is counted by its backing, for
+ * the verbose reports.
+ */
+
+namespace pages {
+
+    enum backing { small, transparent, hugetlb };
+
+    static const size_t huge_size = (size_t)1 << 21;
+
+    inline bool& huge () {
+        static bool h = false;
+        return h;
+    }
+
+    inline std::atomic<size_t>* counts () {
+        static std::atomic<size_t> c[3];
+        return c;
+    }
+
+    /*
+     * Map bytes of memory, on huge pages if they are on.
+     */
+    inline void* map (const size_t bytes) {
+        if (huge()) {
+#ifdef MAP_HUGETLB
+            void* p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (p != MAP_FAILED) {
+                ++counts()[hugetlb];
+                return p;
+            }
+#endif
+            //map one huge page more, and trim the mapping to an aligned one
+            char* q = (char*)mmap(NULL, bytes + huge_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (q == MAP_FAILED)
+                return NULL;
+            size_t head = (huge_size - (size_t)q % huge_size) % huge_size;
+            if (head > 0)
+                munmap(q, head);
+            munmap(q + head + bytes, huge_size - head);
+            q += head;
+#ifdef MADV_HUGEPAGE
+            if (madvise(q, bytes, MADV_HUGEPAGE) == 0) {
+                ++counts()[transparent];
+                return q;
+            }
+#endif
+            ++counts()[small];
+            return q;
+        }
+
+        void* p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+            return NULL;
+        ++counts()[small];
+        return p;
+    }
+
+    inline void unmap (void* p, const size_t bytes) {
+        munmap(p, bytes);
+    }
+
+    /*
+     * The kilobytes of anonymous memory the kernel backs with transparent
+     * huge pages, 0 when unknown.
+     */
+    inline size_t transparent_kb () {
+        size_t kb = 0;
+        FILE* f = fopen("/proc/self/smaps_rollup", "r");
+        if (f == NULL)
+            return 0;
+        char line[256];
+        while (fgets(line, sizeof(line), f))
+            if (sscanf(line, "AnonHugePages: %zu kB", &kb) == 1)
+                break;
+        fclose(f);
+        return kb;
+    }
+
+    /*
+     * Print the backing of the buffers mapped so far.
+     */
+    inline void report (FILE* out) {
+        fprintf(out, "Huge pages %s: %zu buffers on hugetlb pages, %zu on transparent huge pages (%zu kB backed now), %zu on small pages\n",
+                huge() ? "on" : "off",
+                counts()[hugetlb].load(), counts()[transparent].load(),
+                transparent_kb(), counts()[small].load());
+    }
+
+}
+
+#endif
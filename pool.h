@@ -0,0 +1,127 @@
+#ifndef pqvm_pool_h
+#define pqvm_pool_h
+
+#include <climits>
+#include <cstddef>
+#include <memory>
+#include <tbb/spin_mutex.h>
+#include "vector.h"
+
+/**
+ * Size-class buffer pool.
+ * Buffers are handed out in power-of-two size classes; a released buffer
+ * is kept in the free list of its class, so the next request of the same
+ * class gets it back without calling the underlying allocator A.
+ * This turns the double buffering of the quantum operators (allocate the
+ * output, release the input) into a ping-pong between two cached buffers,
+ * instead of a fresh allocation (and a fresh set of page faults) per gate.
+ */
+
+template <class A>
+class buffer_pool {
+public:
+    typedef A allocator_type;
+    typedef typename allocator_type::size_type size_type;
+    typedef typename allocator_type::pointer pointer;
+
+    // number of free buffers we keep per size class
+    static const size_type max_cached = 4;
+
+private:
+    static const size_type num_classes = sizeof(size_type) * CHAR_BIT;
+
+    pointer   _free[num_classes][max_cached];
+    size_type _cached[num_classes];
+    allocator_type _alloc;
+    tbb::spin_mutex _mutex;
+
+    buffer_pool () {
+        for (size_type c = 0; c < num_classes; ++c)
+            _cached[c] = 0;
+    }
+
+    // smallest c such that n <= 2^c
+    static inline size_type size_class (size_type n) {
+        size_type c = 0;
+        while (((size_type)1 << c) < n) ++c;
+        return c;
+    }
+
+public:
+    /*
+     * The pool is never destroyed: registers with static storage duration
+     * may return their buffers after any function-local static would have
+     * been torn down. Call release() to hand cached memory back.
+     */
+    static buffer_pool& instance () {
+        static buffer_pool* pool = new buffer_pool ();
+        return *pool;
+    }
+
+    pointer allocate (const size_type n) {
+        if (n == 0) return NULL;
+        size_type c = size_class(n);
+        {
+            tbb::spin_mutex::scoped_lock lock (_mutex);
+            if (_cached[c] > 0)
+                return _free[c][--_cached[c]];
+        }
+        return _alloc.allocate((size_type)1 << c);
+    }
+
+    void deallocate (pointer p, const size_type n) {
+        if (p == NULL) return;
+        size_type c = size_class(n);
+        {
+            tbb::spin_mutex::scoped_lock lock (_mutex);
+            if (_cached[c] < max_cached) {
+                _free[c][_cached[c]++] = p;
+                return;
+            }
+        }
+        _alloc.deallocate(p, (size_type)1 << c);
+    }
+
+    /*
+     * Return all cached buffers to the underlying allocator.
+     */
+    void release () {
+        tbb::spin_mutex::scoped_lock lock (_mutex);
+        for (size_type c = 0; c < num_classes; ++c)
+            while (_cached[c] > 0)
+                _alloc.deallocate(_free[c][--_cached[c]], (size_type)1 << c);
+    }
+};
+
+/**
+ * Allocator drawing from the buffer pool of its underlying allocator A.
+ * Stateless: all pool_allocators with the same A share a single pool.
+ * The buffers keep the alignment of A.
+ */
+
+template <class T, class A = aligned_allocator<T> >
+class pool_allocator {
+public:
+    typedef T value_type;
+    typedef buffer_pool<A> pool_type;
+    typedef typename A::size_type size_type;
+    typedef typename A::difference_type difference_type;
+    typedef typename A::pointer pointer;
+    typedef typename A::const_pointer const_pointer;
+
+    static const size_type alignment = A::alignment;
+
+    inline pointer allocate (const size_type n) {
+        return pool().allocate(n);
+    }
+
+    inline void deallocate (pointer p, const size_type n) {
+        pool().deallocate(p, n);
+    }
+
+    static inline pool_type& pool () {
+        return pool_type::instance();
+    }
+};
+
+#endif
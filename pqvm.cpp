@@ -1,4 +1,7 @@
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
 #include <unistd.h>
 #include <getopt.h>
 #include <stdio.h>
@@ -16,6 +19,17 @@
 #include <sexp/sexp_vis.h>
 
 #include <iostream>
+#include <vector>
+#include <queue>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <algorithm>
+
+#include <tbb/concurrent_queue.h>
+#include <tbb/spin_mutex.h>
+#include <tbb/task_group.h>
 
 #include "thread-control.h"
 #include "quantum/quantum.h"
@@ -29,6 +43,9 @@
 #define STRING_SIZE (size_t)UCHAR_MAX
 #define MAX_TANGLES (size_t)SHRT_MAX
 #define MAX_QUBITS  (size_t)SHRT_MAX
+// in-place measurement shrinks a register once its size drops to
+//  1/SHRINK_FACTOR of the allocated capacity
+#define SHRINK_FACTOR (size_t)4
 
 #define car hd_sexp
 #define cdr next_sexp
@@ -40,65 +57,172 @@ typedef quantum::size_type pos_t;
 
 int _verbose_ = 0;
 int _in_place_ = 0;
-
-quantum::quregister _proto_diag_qubit_;
-quantum::quregister _proto_dual_diag_qubit_;
+// defer E commands until one of their qubits is measured
+int _lazy_ = 0;
+// reorder the program to keep the tangles small
+int _schedule_ = 0;
+// run the instructions on different tangles concurrently
+int _concurrent_ = 0;
+// run the program while it is read (see STREAMING)
+int _stream_ = 0;
+// guards the tangle table (and count) of the qmem, which the concurrent
+//  instructions share
+tbb::spin_mutex _tangles_mutex_;
+// sample the outcome of measurements, instead of always taking outcome 1
+int _random_ = 0;
+// the seed of the outcomes, the draw of a qubit depends only on it and the qid
+//  so that runs are reproducible whatever the order of the measurements
+uint64_t _seed_ = 0;
+// the number of sampled outcomes 0 and 1
+std::atomic<unsigned long> _outcomes_[2];
+// the number of shots run together (see SHOTS), 0 runs the program once
+uint64_t _shots_ = 0;
+// move the qubits about to be measured to the high targets (see LAYOUT)
+int _layout_ = 0;
+
+// the |+> and dual |+> states, copied into new tangles
+template <class real>
+quantum::basic_quregister<real> _proto_diag_qubit_;
+template <class real>
+quantum::basic_quregister<real> _proto_dual_diag_qubit_;
 
 /************
  ** TANGLE **
  ************/
-typedef struct qid_list {
-    qid_t qid;
-    struct qid_list* rest;
-} qid_list_t;
-
-typedef struct tangle {
+#define MIN_TANGLE_CAPACITY (size_t)8
+
+// a Z (a == b) or CZ operator waiting to be applied, on qid positions
+//  positions are stable when qids are appended, unlike targets
+typedef struct diagonal_op {
+    pos_t a;
+    pos_t b;
+} diagonal_op_t;
+
+// the qids of a tangle are stored contiguously, qids[pos] holds the qid at
+//  position pos; the array grows by doubling its capacity
+// the tangle, and all structures holding tangles, are templated on the real
+//  type of the amplitudes in its quantum register
+// the diagonal operators of a tangle are buffered in 'pending', and applied
+//  in a single pass over the register when a non-diagonal operator needs it
+// 'phase' is the global phase the register owes, picked up by moving Pauli
+//  corrections through other operators (see the Pauli frame in qmem)
+// 'refs' counts the qmems holding the tangle: forked shots share their
+//  tangles until one of them writes to it (see own_tangle)
+template <class real>
+struct tangle_t {
     qid_t size;
-    qid_list_t* qids;
-    quantum::quregister qureg;
-} tangle_t;
+    qid_t capacity;
+    qid_t* qids;
+    qid_t pending_size;
+    qid_t pending_capacity;
+    diagonal_op_t* pending;
+    std::complex<double> phase;
+    int refs;
+    quantum::basic_quregister<real> qureg;
+};
 
-tangle_t* init_tangle() {
-    tangle_t* tangle = (tangle_t*) malloc(sizeof(tangle_t));   //ALLOC tangle
+template <class real>
+tangle_t<real>* init_tangle() {
+    tangle_t<real>* tangle = (tangle_t<real>*) malloc(sizeof(tangle_t<real>));   //ALLOC tangle
     tangle->size = 0;
+    tangle->capacity = 0;
     tangle->qids = NULL;
+    tangle->pending_size = 0;
+    tangle->pending_capacity = 0;
+    tangle->pending = NULL;
+    tangle->phase = 1.0;
+    tangle->refs = 1;
     tangle->qureg.reset();
     return tangle;
 }
 
-void free_qid_list( qid_list_t* qids) {
-    qid_list_t* rest = NULL;
-    while( qids ) {
-        rest = qids->rest;
-        free( qids );
-        qids = rest;
-    }
-}
-
-void free_tangle( tangle_t* tangle ) {
-    free_qid_list( tangle->qids );
+template <class real>
+void free_tangle( tangle_t<real>* tangle ) {
+    free( tangle->qids ); // FREE QID ARRAY
     tangle->size = 0;
+    tangle->capacity = 0;
     tangle->qids = NULL;
+    free( tangle->pending ); // FREE PENDING ARRAY
+    tangle->pending_size = 0;
+    tangle->pending_capacity = 0;
+    tangle->pending = NULL;
     tangle->qureg.empty();
     free( tangle ); //FREE tangle
 }
 
-void print_qids( const qid_list_t* qids ) {
+// make room for at least n qids, keeping the current ones
+template <class real>
+void reserve_qids( tangle_t<real>* tangle, const qid_t n ) {
+    if( n <= tangle->capacity )
+        return;
+    qid_t capacity = tangle->capacity ? tangle->capacity : MIN_TANGLE_CAPACITY;
+    while( capacity < n )
+        capacity <<= 1;
+    // (RE)ALLOC QID ARRAY
+    tangle->qids = (qid_t*) realloc(tangle->qids, capacity * sizeof(qid_t));
+    if( tangle->qids == NULL ) {
+        printf("ERROR: could not allocate room for %ld qids\n", capacity);
+        exit(EXIT_FAILURE);
+    }
+    tangle->capacity = capacity;
+}
+
+// make room for at least n pending operators, keeping the current ones
+template <class real>
+void reserve_pending( tangle_t<real>* tangle, const qid_t n ) {
+    if( n <= tangle->pending_capacity )
+        return;
+    qid_t capacity = tangle->pending_capacity ? tangle->pending_capacity : MIN_TANGLE_CAPACITY;
+    while( capacity < n )
+        capacity <<= 1;
+    // (RE)ALLOC PENDING ARRAY
+    tangle->pending = (diagonal_op_t*) realloc(tangle->pending, capacity * sizeof(diagonal_op_t));
+    if( tangle->pending == NULL ) {
+        printf("ERROR: could not allocate room for %ld pending operators\n", capacity);
+        exit(EXIT_FAILURE);
+    }
+    tangle->pending_capacity = capacity;
+}
+
+// a new tangle with the qids, pending operators and phase of another, but
+//  an empty register
+template <class real>
+tangle_t<real>* copy_tangle( const tangle_t<real>* tangle ) {
+    tangle_t<real>* copy = init_tangle<real>();
+    reserve_qids( copy, tangle->size );
+    memcpy( copy->qids, tangle->qids, tangle->size * sizeof(qid_t) );
+    copy->size = tangle->size;
+    if( tangle->pending_size ) {
+        reserve_pending( copy, tangle->pending_size );
+        memcpy( copy->pending, tangle->pending, tangle->pending_size * sizeof(diagonal_op_t) );
+        copy->pending_size = tangle->pending_size;
+    }
+    copy->phase = tangle->phase;
+    return copy;
+}
+
+// drops a qmem's hold on a tangle, the last one frees it
+template <class real>
+void release_tangle( tangle_t<real>* tangle ) {
+    if( --tangle->refs == 0 )
+        free_tangle( tangle );
+}
+
+template <class real>
+void print_qids( const tangle_t<real>* tangle ) {
     printf("[");
-    const qid_list_t* cons = qids;
-    for( ;
-        cons;
-        cons=cons->rest ) {
-        printf("%ld", cons->qid);
-        if( cons->rest )
+    for( pos_t pos=0 ; pos < tangle->size ; ++pos ) {
+        printf("%ld", tangle->qids[pos]);
+        if( pos+1 < tangle->size )
             printf(", ");
     }
     printf("]");
 }
 
-void print_tangle( const tangle_t* tangle ) {
+template <class real>
+void print_tangle( const tangle_t<real>* tangle ) {
     assert( tangle );
-    print_qids( tangle->qids );
+    print_qids( tangle );
     printf(" ,\n    {\n");
     if( tangle->qureg.size() > 32 ) {
         printf("<a large quantum state>, really print? (y/N): ");
@@ -113,25 +237,33 @@ void print_tangle( const tangle_t* tangle ) {
 /***********
  ** QUBIT **
  ***********/
-typedef struct qubit {
-    tangle_t* tangle;
+template <class real>
+struct qubit_t {
+    tangle_t<real>* tangle;
     qid_t qid;
     pos_t pos;
-} qubit_t;
+};
 
-qubit_t _invalid_qubit_ = { NULL, 0, 0 };
+template <class real>
+const qubit_t<real> _invalid_qubit_ = { NULL, 0, 0 };
 
 // use this function to return a correct qureg position
 //  libquantum uses an reverse order (least significant == 0)
 //  as does namespace ::quantum
-pos_t get_target( const qubit_t qubit ) {
+//  qids[pos] is the qubit at target (size - pos - 1), so appending a qid
+//  shifts all existing targets up by one without touching the array
+template <class real>
+pos_t get_target( const qubit_t<real> qubit ) {
     return qubit.tangle->size - qubit.pos - 1;
 }
 
-bool invalid( const qubit_t qubit ) {
+template <class real>
+bool invalid( const qubit_t<real> qubit ) {
     return qubit.tangle == NULL;
 }
-quantum::quregister& get_qureg( const qubit_t qubit ) {
+
+template <class real>
+quantum::basic_quregister<real>& get_qureg( const qubit_t<real> qubit ) {
     return qubit.tangle->qureg;
 }
 
@@ -148,11 +280,40 @@ typedef struct signal_map {
     unsigned char signals[BITNSLOTS(MAX_QUBITS)];
 } signal_map_t;
 
-typedef struct qmem {
+// the Pauli frame of a qubit: the X and Z corrections it still owes, the
+//  actual state is X^x Z^z (in that order) applied to the register
+#define FRAME_X (unsigned char)1
+#define FRAME_Z (unsigned char)2
+// a global -1, taken over by the qubit's tangle
+#define FRAME_SIGN (unsigned char)4
+
+// an E command deferred in lazy mode
+typedef struct edge {
+    qid_t a;
+    qid_t b;
+} edge_t;
+
+// dense qid-indexed table: which tangle holds a qid, at which position, its
+//  Pauli frame and its number of deferred edges
+//  kept up to date by every function that adds, moves or removes qids
+template <class real>
+struct qubit_entry_t {
+    tangle_t<real>* tangle;
+    pos_t pos;
+    unsigned char frame;
+    qid_t degree;
+};
+
+template <class real>
+struct qmem_t {
     size_t size;
     signal_map_t signal_map;
-    tangle_t* tangles[MAX_TANGLES];
-} qmem_t;
+    tangle_t<real>* tangles[MAX_TANGLES];
+    qubit_entry_t<real> qubits[MAX_QUBITS];
+    qid_t edges_size;
+    qid_t edges_capacity;
+    edge_t* edges;
+};
 
 
 void print_signal_map( const signal_map_t* signal_map ) {
@@ -167,8 +328,8 @@ void print_signal_map( const signal_map_t* signal_map ) {
 
 bool get_signal( const qid_t qid,
                 const signal_map_t* signal_map ) {
-    if( BITTEST(signal_map->entries,qid) )
-        return BITTEST(signal_map->signals, qid);
+    if( BITTEST_ATOMIC(signal_map->entries,qid) )
+        return BITTEST_ATOMIC(signal_map->signals, qid);
     else {
         printf( "ERROR: I was asked a signal map entry (qid:%ld) that wasn't there,\n\
                check quantum program correctness.\n", qid);
@@ -181,93 +342,103 @@ bool get_signal( const qid_t qid,
 void set_signal( const qid_t qid,
                 const bool signal,
                 signal_map_t* signal_map ) {
-    if( BITTEST(signal_map->entries, qid) ) {
+    if( BITTEST_ATOMIC(signal_map->entries, qid) ) {
         printf( "ERROR: I was asked to set an already existing signal,\n\
                check quantum program correctness.\n");
         printf( "   signal map:\n     ");
         print_signal_map( signal_map );
         exit(EXIT_FAILURE);
     }
-    BITSET(signal_map->entries, qid);
+    // the value first: a reader that sees the entry sees the value
     if( signal )
-        BITSET(signal_map->signals, qid);
+        BITSET_ATOMIC(signal_map->signals, qid);
+    BITSET_ATOMIC(signal_map->entries, qid);
 }
 
-qubit_t
+template <class real>
+qubit_t<real>
 find_qubit_in_tangle( const qid_t qid,
-                     const tangle_t* tangle )
+                     const tangle_t<real>* tangle )
 {
     assert(tangle);
-    qid_list_t* qids = tangle->qids;
     if( tangle->size == 0 ) {
         printf("WARNING: looking for qid in empty tangle, this is not "
                "supposed to happen (deallocate this tangle)\n");
-        return _invalid_qubit_;
+        return _invalid_qubit_<real>;
     }
-    for( quantum::size_type i=0;
-        qids;
-        ++i, qids=qids->rest ) {
-        if( qids->qid == qid )
-            return (qubit_t){ (tangle_t*)tangle, qid, i };
+    for( pos_t pos=0 ; pos < tangle->size ; ++pos ) {
+        if( tangle->qids[pos] == qid )
+            return (qubit_t<real>){ (tangle_t<real>*)tangle, qid, pos };
     }
-    return _invalid_qubit_;
+    return _invalid_qubit_<real>;
 }
 
-qubit_t
-find_qubit(const qid_t qid, const qmem_t* qmem) {
-    tangle_t* tangle;
-    qubit_t qubit;
-    for( int i=0, tally=0 ; tally < qmem->size ; ++i ) {
-        tangle = qmem->tangles[i];
-        if( tangle ) {
-            qubit = find_qubit_in_tangle(qid, tangle);
-            if( !invalid(qubit) )
-                return qubit;
-            ++tally;
-        }
+void ensure_qid( const qid_t qid ) {
+    if( qid >= MAX_QUBITS ) {
+        printf("ERROR: qid %ld is out of range, I can only handle qids "
+               "below %lu\n", qid, MAX_QUBITS);
+        exit(EXIT_FAILURE);
     }
-    return _invalid_qubit_;
 }
 
-qid_list_t* add_qid( const qid_t qid, qid_list_t* qids ) {
-    // assuming qid is NOT already in qids
-    // ALLOC QUBIT LIST
-    qid_list_t* new_qids = (qid_list_t*) malloc(sizeof(qid_list_t));
-    new_qids->qid = qid;
-    new_qids->rest = qids;
-    return new_qids;
+// constant time lookup in the qmem qubit table
+template <class real>
+qubit_t<real>
+find_qubit(const qid_t qid, const qmem_t<real>* qmem) {
+    ensure_qid( qid );
+    const qubit_entry_t<real>* entry = &qmem->qubits[qid];
+    if( entry->tangle == NULL )
+        return _invalid_qubit_<real>;
+    return (qubit_t<real>){ entry->tangle, qid, entry->pos };
 }
 
-void append_qids( qid_list_t* new_qids, qid_list_t* target_qids ) {
-    assert( new_qids && target_qids );
-    while( target_qids->rest ) {
-        target_qids = target_qids->rest;
-    }
-    target_qids->rest = new_qids;
+template <class real>
+void index_qubit( const qid_t qid,
+                 tangle_t<real>* tangle,
+                 const pos_t pos,
+                 qmem_t<real>* qmem ) {
+    ensure_qid( qid );
+    // the frame moves along with the qubit
+    qmem->qubits[qid].tangle = tangle;
+    qmem->qubits[qid].pos = pos;
+}
+
+template <class real>
+void unindex_qubit( const qid_t qid, qmem_t<real>* qmem ) {
+    ensure_qid( qid );
+    qmem->qubits[qid] = (qubit_entry_t<real>){ NULL, 0, 0, 0 };
+}
+
+// (re)index every qid of a tangle, starting at position 'from'
+template <class real>
+void index_qids( tangle_t<real>* tangle, const pos_t from, qmem_t<real>* qmem ) {
+    for( pos_t pos = from ; pos < tangle->size ; ++pos )
+        index_qubit( tangle->qids[pos], tangle, pos, qmem );
+}
+
+// appends a single qid:  qids := [[qids...],qid]
+//  assuming qid is NOT already in qids
+template <class real>
+void append_qid( const qid_t qid, tangle_t<real>* tangle ) {
+    reserve_qids( tangle, tangle->size + 1 );
+    tangle->qids[tangle->size] = qid;
+    tangle->size += 1;
 }
 
-/* void remove_qid( qid_t qid, qid_list_t* restrict qids ) { */
-/*   qid_list_t* restrict next; */
-/*   if( qids ) { */
-/*     next = qids->rest; */
-/*     if( next ) { */
-/*       if( next->qid == qid ) { */
-/* 	qids->rest = next->rest; */
-/* 	free( next ); */
-/*       } */
-/*       else { */
-/* 	remove_qid( qid, next ); */
-/*       } */
-/*     } */
-/*   } */
-/*   else */
-/*     // recursion stops if qid was not found */
-/*     printf("Warning: I was asked to remove qid %d from a tangle that did" */
-/* 	   "not have it\n", qid); */
-/* } */
+// appends all qids of source to target as one block
+template <class real>
+void append_qids( const tangle_t<real>* source, tangle_t<real>* target ) {
+    assert( source && target );
+    reserve_qids( target, target->size + source->size );
+    memcpy( target->qids + target->size,
+           source->qids,
+           source->size * sizeof(qid_t) );
+    target->size += source->size;
+}
 
 
-void print_qmem( const qmem_t* qmem ) {
+template <class real>
+void print_qmem( const qmem_t<real>* qmem ) {
     assert(qmem);
     printf("qmem has %d tangles:\n  {", (int)qmem->size);
     for( int i=0, tally=0 ; tally < qmem->size ; ++i ) {
@@ -284,32 +455,42 @@ void print_qmem( const qmem_t* qmem ) {
     print_signal_map( &qmem->signal_map );
 }
 
-qmem_t* init_qmem() {
-    qmem_t* qmem = (qmem_t*) malloc(sizeof(qmem_t)); //ALLOC qmem
+template <class real>
+qmem_t<real>* init_qmem() {
+    qmem_t<real>* qmem = (qmem_t<real>*) malloc(sizeof(qmem_t<real>)); //ALLOC qmem
     
     qmem->size = 0;
     //qmem->tangles = calloc(MAX_TANGLES,sizeof(tangle_t*)); //ALLOC tangles
     //memset(&qmem->tangles, 0, sizeof(tangle_t*) * MAX_TANGLES);
     for( int i=0; i<MAX_TANGLES; ++i )
         qmem->tangles[i] = NULL;
+    for( qid_t qid=0; qid<MAX_QUBITS; ++qid )
+        qmem->qubits[qid] = (qubit_entry_t<real>){ NULL, 0, 0, 0 };
     qmem->signal_map = (signal_map_t){{0},{0}};
+    qmem->edges_size = 0;
+    qmem->edges_capacity = 0;
+    qmem->edges = NULL;
     
     // instantiate prototypes (libquantum quregs)
+    //  once, they are shared by all qmems (of a batch)
     
     //quantum_hadamard(0, &_proto_diag_qubit_);
     //quantum_hadamard(0, &_proto_dual_diag_qubit_);
     //quantum_hadamard(1, &_proto_dual_diag_qubit_);
     //quantum_gate2(0, 1, _cz_gate_, &_proto_dual_diag_qubit_);
     
-    _proto_diag_qubit_.reserve(2);
-    _proto_dual_diag_qubit_.reserve(4);
-    
-    _proto_diag_qubit_[0] = std::sqrt(0.5);
-    _proto_diag_qubit_[1] = std::sqrt(0.5);
-    _proto_dual_diag_qubit_[0] =  0.5;
-    _proto_dual_diag_qubit_[1] =  0.5;
-    _proto_dual_diag_qubit_[2] =  0.5;
-    _proto_dual_diag_qubit_[3] = -0.5;
+    static std::once_flag prototypes;
+    std::call_once( prototypes, []{
+        _proto_diag_qubit_<real>.reserve(2);
+        _proto_dual_diag_qubit_<real>.reserve(4);
+        
+        _proto_diag_qubit_<real>[0] = std::sqrt(0.5);
+        _proto_diag_qubit_<real>[1] = std::sqrt(0.5);
+        _proto_dual_diag_qubit_<real>[0] =  0.5;
+        _proto_dual_diag_qubit_<real>[1] =  0.5;
+        _proto_dual_diag_qubit_<real>[2] =  0.5;
+        _proto_dual_diag_qubit_<real>[3] = -0.5;
+    } );
     
     // seed RNG
     //sranddev();
@@ -317,29 +498,92 @@ qmem_t* init_qmem() {
     return qmem;
 }
 
-void free_qmem(qmem_t* qmem) {
-    _proto_diag_qubit_.empty();
-    _proto_dual_diag_qubit_.empty();
+template <class real>
+void free_qmem(qmem_t<real>* qmem) {
+    // the prototypes stay, for the next qmem
     
     for( int i=0, tally=0 ; tally < qmem->size ; i++ ) {
         assert(i<MAX_TANGLES);
         if( qmem->tangles[i] ) {
-            free_tangle(qmem->tangles[i]);
+            release_tangle(qmem->tangles[i]);
             qmem->tangles[i] = NULL;
             ++tally;
         }
     }
     //free(qmem->tangles); //FREE tangles
+    free(qmem->edges); //FREE edges
     free(qmem); //FREE qmem
+    // the cached quregister buffers stay too, see release_buffers
+}
+
+// hands the cached quregister buffers back, once no qmem is left to reuse them
+template <class real>
+void release_buffers() {
+    quantum::types<real>::allocator::pool().release();
+}
+
+// a copy of qmem that shares its tangles, see own_tangle
+template <class real>
+qmem_t<real>* fork_qmem( const qmem_t<real>* qmem ) {
+    qmem_t<real>* fork = (qmem_t<real>*) malloc(sizeof(qmem_t<real>)); //ALLOC qmem
+    memcpy( fork, qmem, sizeof(qmem_t<real>) );
+    fork->edges_capacity = 0;
+    fork->edges = NULL;
+    reserve_edges( fork, qmem->edges_size );
+    if( qmem->edges_size )
+        memcpy( fork->edges, qmem->edges, qmem->edges_size * sizeof(edge_t) );
+    for( size_t i=0, tally=0 ; tally < qmem->size ; ++i )
+        if( qmem->tangles[i] ) {
+            qmem->tangles[i]->refs += 1;
+            ++tally;
+        }
+    return fork;
+}
+
+// puts copy in the place of tangle in qmem, which lets go of tangle
+template <class real>
+void replace_tangle( tangle_t<real>* tangle, tangle_t<real>* copy, qmem_t<real>* qmem ) {
+    for( size_t i=0; i<MAX_TANGLES; ++i )
+        if( qmem->tangles[i] == tangle ) {
+            qmem->tangles[i] = copy;
+            break;
+        }
+    index_qids( copy, 0, qmem );
+    release_tangle( tangle );
 }
 
-tangle_t* get_free_tangle(qmem_t* qmem) {
-    tangle_t* new_tangle = init_tangle();
+// copy on write: a tangle shared with other qmems is copied before qmem
+//  changes it; a tangle of a single qmem is returned as is
+template <class real>
+tangle_t<real>* own_tangle( tangle_t<real>* tangle, qmem_t<real>* qmem ) {
+    if( tangle->refs == 1 )
+        return tangle;
+    tangle_t<real>* copy = copy_tangle( tangle );
+    quantum::backend<real>::copy( tangle->qureg, copy->qureg );
+    replace_tangle( tangle, copy, qmem );
+    return copy;
+}
+
+// find_qubit, for a qubit about to be changed
+template <class real>
+qubit_t<real> find_own_qubit( const qid_t qid, qmem_t<real>* qmem ) {
+    qubit_t<real> qubit = find_qubit( qid, qmem );
+    if( !invalid(qubit) )
+        qubit.tangle = own_tangle( qubit.tangle, qmem );
+    return qubit;
+}
+
+// adds a new (empty) tangle to qmem
+template <class real>
+tangle_t<real>* get_free_tangle(qmem_t<real>* qmem) {
+    tangle_t<real>* new_tangle = init_tangle<real>();
     assert(new_tangle);
+    tbb::spin_mutex::scoped_lock lock( _tangles_mutex_ );
     // I loop here because tangles can get de-allocated (NULL-ed)
     for(int i=0; i<MAX_TANGLES; ++i) {
         if( qmem->tangles[i] == NULL ) {
             qmem->tangles[i] = new_tangle;
+            qmem->size += 1;
             return new_tangle;
         }
     }
@@ -347,76 +591,73 @@ tangle_t* get_free_tangle(qmem_t* qmem) {
     exit(EXIT_FAILURE);
 }
 
-tangle_t*
+template <class real>
+tangle_t<real>*
 add_dual_tangle( const qid_t qid1,
                 const qid_t qid2,
-                qmem_t* qmem) {
+                qmem_t<real>* qmem) {
     // allocate new tangle in qmem
-    tangle_t*  tangle = get_free_tangle(qmem);
+    tangle_t<real>*  tangle = get_free_tangle(qmem);
     
     // init tangle
-    tangle->qids = add_qid( qid2, tangle->qids );
-    tangle->qids = add_qid( qid1, tangle->qids );
-    tangle->size = 2;
+    append_qid( qid1, tangle );
+    append_qid( qid2, tangle );
     
     // update qmem info
-    qmem->size += 1;
+    index_qids( tangle, 0, qmem );
     
     // init quantum state
-    quantum::copy (_proto_dual_diag_qubit_, tangle->qureg);
+    quantum::backend<real>::copy (_proto_dual_diag_qubit_<real>, tangle->qureg);
     
     return tangle;
 }
 
-tangle_t*
+template <class real>
+tangle_t<real>*
 add_tangle( const qid_t qid,
-           qmem_t* qmem ) {
+           qmem_t<real>* qmem ) {
     // allocate new tangle in qmem
-    tangle_t* tangle = get_free_tangle(qmem);
+    tangle_t<real>* tangle = get_free_tangle(qmem);
     // init tangle
-    tangle->qids = add_qid( qid, tangle->qids );
-    tangle->size = 1;
+    append_qid( qid, tangle );
     // update qmem info
-    qmem->size += 1;
+    index_qubit( qid, tangle, 0, qmem );
     // init quantum state
-    quantum::copy (_proto_diag_qubit_, tangle->qureg);
+    quantum::backend<real>::copy (_proto_diag_qubit_<real>, tangle->qureg);
     return tangle;
 }
 
 
 /* Adds new qubit BEHIND existing state: |q> x |+>
  */
+template <class real>
 void
 add_qubit( const qid_t qid,
-          tangle_t* tangle) {
+          tangle_t<real>* tangle,
+          qmem_t<real>* qmem) {
     assert(tangle);
     // appends new qid:  qids := [[qids...],qid]
-    append_qids( add_qid(qid,NULL), tangle->qids );
-    tangle->size += 1;
-    // tensor |+> to tangle
-    quantum::quregister old_qureg = tangle->qureg;
-    tangle->qureg.reset();
-    quantum::kronecker(old_qureg, _proto_diag_qubit_, tangle->qureg);
-    
-    // out with the old
-    //quantum_delete( &tangle->qureg );
-    // in with the new
-    //tangle->qureg = new_qureg;
-    
-    // ::quantum : destructor takes care of deallocation of old_qureg
-    // check for leaks with valgrind to be sure
+    append_qid( qid, tangle );
+    index_qubit( qid, tangle, tangle->size - 1, qmem );
+    // tensor |+> to tangle, in place: grows within the register's capacity
+    //  (e.g. left over from an earlier measurement) when possible
+    quantum::backend<real>::expand(tangle->qureg, tangle->qureg);
 }
 
+template <class real>
 void
-delete_tangle( tangle_t* tangle,
-              qmem_t* qmem ) {
+delete_tangle( tangle_t<real>* tangle,
+              qmem_t<real>* qmem ) {
     assert( tangle );
-    assert( tangle->qids == NULL );
+    assert( tangle->size == 0 );
+    assert( tangle->pending_size == 0 );
+    tbb::spin_mutex::scoped_lock lock( _tangles_mutex_ );
     qmem->size -= 1;
     // null the tangle entry in qmem
     for(int i=0; i<MAX_TANGLES; ++i) {
         if( qmem->tangles[i] == tangle ) {
             qmem->tangles[i] = NULL;
+            lock.release();
             free_tangle( tangle );
             return;
         }
@@ -426,49 +667,60 @@ delete_tangle( tangle_t* tangle,
     exit(EXIT_FAILURE);
 }
 
+template <class real>
 void
-delete_qubit(const qubit_t qubit,
-             qmem_t* qmem) {
+delete_qubit(const qubit_t<real> qubit,
+             qmem_t<real>* qmem) {
     assert( !invalid(qubit) );
-    tangle_t* tangle = qubit.tangle;
-    // handle points to where current qid entry is stored
-    qid_list_t** handle = &tangle->qids;
-    qid_list_t* qids = tangle->qids;
-    
-    // listref by qubit.pos
-    for( int i=0 ; i < qubit.pos ; ++i ) {
-        handle = &qids->rest;
-        qids = qids->rest;
-    }
-    assert(qids);
-    assert(qids->qid == qubit.qid);
-    
-    // pointer plumbing:
-    //  bypass current qid entry
-    *handle = qids->rest;
+    tangle_t<real>* tangle = qubit.tangle;
+    assert( qubit.pos < tangle->size );
+    assert( tangle->qids[qubit.pos] == qubit.qid );
+    
+    // compact: shift the qids behind the deleted one a position down
+    memmove( tangle->qids + qubit.pos,
+            tangle->qids + qubit.pos + 1,
+            (tangle->size - qubit.pos - 1) * sizeof(qid_t) );
     tangle->size -= 1;
+    // the pending operators do not involve the deleted qubit, shift theirs too
+    for( qid_t k=0 ; k < tangle->pending_size ; ++k ) {
+        diagonal_op_t* op = &tangle->pending[k];
+        assert( op->a != qubit.pos && op->b != qubit.pos );
+        if( op->a > qubit.pos ) op->a -= 1;
+        if( op->b > qubit.pos ) op->b -= 1;
+    }
     
-    free(qids); // FREE QUBIT LIST element
-                // when empty, dealloc tangle
-    if( tangle->size == 0 ) {
-        tangle->qids = NULL;
+    unindex_qubit( qubit.qid, qmem );
+    index_qids( tangle, qubit.pos, qmem );
+    
+    // when empty, dealloc tangle
+    if( tangle->size == 0 )
         delete_tangle( tangle, qmem );
-    }
 }
 
+template <class real>
 void
-merge_tangles(tangle_t* tangle_1,
-              tangle_t* tangle_2,
-              qmem_t* qmem) {
+merge_tangles(tangle_t<real>* tangle_1,
+              tangle_t<real>* tangle_2,
+              qmem_t<real>* qmem) {
     assert( tangle_1 && tangle_2 );
-    tangle_1->size = tangle_1->size + tangle_2->size;
-    // append qids of tangle_2 to tangle_1, destructively
-    append_qids( tangle_2->qids, tangle_1->qids);
+    const pos_t offset = tangle_1->size;
+    // append qids of tangle_2 to tangle_1
+    append_qids( tangle_2, tangle_1 );
+    index_qids( tangle_1, offset, qmem );
+    // the pending operators commute with the tensor product, move them along
+    reserve_pending( tangle_1, tangle_1->pending_size + tangle_2->pending_size );
+    for( qid_t k=0 ; k < tangle_2->pending_size ; ++k ) {
+        diagonal_op_t op = tangle_2->pending[k];
+        tangle_1->pending[tangle_1->pending_size++] =
+            (diagonal_op_t){ op.a + offset, op.b + offset };
+    }
+    tangle_2->pending_size = 0;
+    tangle_1->phase *= tangle_2->phase;
     // tensor both quregs
-    quantum::quregister old_tangle1 = tangle_1->qureg;
+    quantum::basic_quregister<real> old_tangle1 = tangle_1->qureg;
     tangle_1->qureg.reset();
     
-    quantum::kronecker( old_tangle1, tangle_2->qureg, tangle_1->qureg );
+    quantum::backend<real>::kronecker( old_tangle1, tangle_2->qureg, tangle_1->qureg );
     
     // out with the old
     //quantum_delete_qureg( &tangle_1->qureg );
@@ -477,7 +729,7 @@ merge_tangles(tangle_t* tangle_1,
     //tangle_1->qureg = new_qureg;
     //deallocation happens on old_tangle1 and in delete_tangle (tangle_2)
     
-    tangle_2->qids = NULL; // avoids the qid_list from being collected
+    tangle_2->size = 0;
     delete_tangle( tangle_2, qmem ); //free the tangle
 }
 
@@ -621,55 +873,449 @@ double parse_angle( const sexp_t* exp ) {
     return angle;
 }
 
-void qop_cz( const qubit_t qubit_1, const qubit_t qubit_2 ) {
-    const quantum::size_type tar1 = get_target(qubit_1);
-    const quantum::size_type tar2 = get_target(qubit_2);
-    assert( !(invalid(qubit_1) || invalid(qubit_2)) );
+// buffers a diagonal operator on positions a and b (a == b for Z)
+//  Z and CZ are their own inverse: applying one twice cancels it
+template <class real>
+void push_diagonal( tangle_t<real>* tangle, pos_t a, pos_t b ) {
+    if( a > b )
+        std::swap( a, b );
+    for( qid_t k=0 ; k < tangle->pending_size ; ++k ) {
+        if( tangle->pending[k].a == a && tangle->pending[k].b == b ) {
+            tangle->pending[k] = tangle->pending[--tangle->pending_size];
+            return;
+        }
+    }
+    reserve_pending( tangle, tangle->pending_size + 1 );
+    tangle->pending[tangle->pending_size++] = (diagonal_op_t){ a, b };
+}
+
+// does a pending operator act on the qubit?
+template <class real>
+bool pending_on( const qubit_t<real> qubit ) {
+    const tangle_t<real>* tangle = qubit.tangle;
+    for( qid_t k=0 ; k < tangle->pending_size ; ++k ) {
+        if( tangle->pending[k].a == qubit.pos || tangle->pending[k].b == qubit.pos )
+            return true;
+    }
+    return false;
+}
+
+// a run of one uses the operator's own kernel, longer runs the fused one
+template <class real>
+void apply_diagonal( const tangle_t<real>* tangle,
+                    const quantum::size_type* masks,
+                    const qid_t count,
+                    quantum::basic_quregister<real>& input,
+                    quantum::basic_quregister<real>& output ) {
+    if( count == 1 ) {
+        const diagonal_op_t op = tangle->pending[0];
+        if( op.a == op.b )
+            quantum::backend<real>::sigma_z( tangle->size - op.a - 1, input, output );
+        else
+            quantum::backend<real>::controlled_z( tangle->size - op.a - 1, tangle->size - op.b - 1, input, output );
+    }
+    else
+        quantum::backend<real>::diagonal( masks, count, input, output );
+}
+
+// applies all pending operators of the tangle, in one pass over its register
+template <class real>
+void flush_diagonal( tangle_t<real>* tangle ) {
+    const qid_t count = tangle->pending_size;
+    if( count == 0 )
+        return;
+    
+    quantum::size_type* masks = (quantum::size_type*) malloc(count * sizeof(quantum::size_type)); //ALLOC masks
+    for( qid_t k=0 ; k < count ; ++k ) {
+        const diagonal_op_t op = tangle->pending[k];
+        masks[k] = ((quantum::size_type)1 << (tangle->size - op.a - 1)) |
+                   ((quantum::size_type)1 << (tangle->size - op.b - 1));
+    }
+    
+    if (_in_place_) {
+        apply_diagonal( tangle, masks, count, tangle->qureg, tangle->qureg );
+    }
+    else {
+        quantum::basic_quregister<real> old_qureg = tangle->qureg;
+        tangle->qureg.reset();
+        apply_diagonal( tangle, masks, count, old_qureg, tangle->qureg );
+    }
+    tangle->pending_size = 0;
+    free( masks ); //FREE masks
+}
+
+// applies a list of gates to the register of the tangle, in tiles
+template <class real>
+void apply_gates( tangle_t<real>* tangle, const quantum::gate* list, const qid_t count ) {
+    if (_in_place_) {
+        quantum::backend<real>::gates( list, count, tangle->qureg, tangle->qureg );
+    }
+    else {
+        quantum::basic_quregister<real> old_qureg = tangle->qureg;
+        tangle->qureg.reset();
+        quantum::backend<real>::gates( list, count, old_qureg, tangle->qureg );
+    }
+}
+
+// applies the Pauli frames and the global phase a tangle owes to its register
+//  the Z corrections join the pending diagonal operators; with X corrections
+//  too, they all go in one gate list, so that they share the passes over
+//  the register
+template <class real>
+void flush_frame( tangle_t<real>* tangle, qmem_t<real>* qmem ) {
+    qid_t corrections = 0;
+    for( pos_t pos=0 ; pos < tangle->size ; ++pos ) {
+        const unsigned char frame = qmem->qubits[tangle->qids[pos]].frame;
+        if( frame & FRAME_Z )
+            push_diagonal( tangle, pos, pos );
+        if( frame & FRAME_X )
+            ++corrections;
+    }
+    
+    if( corrections == 0 )
+        flush_diagonal( tangle );
+    else {
+        const qid_t count = tangle->pending_size + corrections;
+        quantum::gate* list = (quantum::gate*) malloc(count * sizeof(quantum::gate)); //ALLOC gates
+        qid_t k = 0;
+        for( ; k < tangle->pending_size ; ++k ) {
+            const diagonal_op_t op = tangle->pending[k];
+            list[k].op = op.a == op.b ? quantum::gate::z : quantum::gate::cz;
+            list[k].a = tangle->size - op.a - 1;
+            list[k].b = tangle->size - op.b - 1;
+            list[k].angle = 0;
+        }
+        for( pos_t pos=0 ; pos < tangle->size ; ++pos ) {
+            if( qmem->qubits[tangle->qids[pos]].frame & FRAME_X ) {
+                list[k].op = quantum::gate::x;
+                list[k].a = list[k].b = tangle->size - pos - 1;
+                list[k].angle = 0;
+                ++k;
+            }
+        }
+        apply_gates( tangle, list, count );
+        tangle->pending_size = 0;
+        free( list ); //FREE gates
+    }
+    
+    for( pos_t pos=0 ; pos < tangle->size ; ++pos ) {
+        qubit_entry_t<real>* entry = &qmem->qubits[tangle->qids[pos]];
+        if( entry->frame & FRAME_SIGN )
+            tangle->phase = -tangle->phase;
+        entry->frame = 0;
+    }
+    
+    if( tangle->phase != 1.0 ) {
+        const std::complex<real> phase (tangle->phase);
+        if (_in_place_) {
+            quantum::backend<real>::scale( phase, tangle->qureg, tangle->qureg );
+        }
+        else {
+            quantum::basic_quregister<real> old_qureg = tangle->qureg;
+            tangle->qureg.reset();
+            quantum::backend<real>::scale( phase, old_qureg, tangle->qureg );
+        }
+        tangle->phase = 1.0;
+    }
+}
+
+// the corrections do not touch the register, they update the Pauli frame:
+//  X          x ^= 1
+//  Z          z ^= 1, and Z X = -X Z
+//  CZ(a,b)    z_a ^= x_b, z_b ^= x_a, as CZ X_a = X_a Z_b CZ,
+//             and -1 when both have an X
+//  the -1 is kept in a frame as well, as the qubit may not be in a tangle yet
+
+template <class real>
+void frame_cz( const qid_t qid_1, const qid_t qid_2, qmem_t<real>* qmem ) {
+    unsigned char& frame_1 = qmem->qubits[qid_1].frame;
+    unsigned char& frame_2 = qmem->qubits[qid_2].frame;
+    const bool x_1 = frame_1 & FRAME_X;
+    const bool x_2 = frame_2 & FRAME_X;
+    if( x_2 )
+        frame_1 ^= FRAME_Z;
+    if( x_1 )
+        frame_2 ^= FRAME_Z;
+    if( x_1 && x_2 )
+        frame_1 ^= FRAME_SIGN;
+}
+
+template <class real>
+void frame_x( const qid_t qid, qmem_t<real>* qmem ) {
+    qmem->qubits[qid].frame ^= FRAME_X;
+}
+
+template <class real>
+void frame_z( const qid_t qid, qmem_t<real>* qmem ) {
+    unsigned char& frame = qmem->qubits[qid].frame;
+    if( frame & FRAME_X )
+        frame ^= FRAME_SIGN;
+    frame ^= FRAME_Z;
+}
+
+// brings two qubits in one tangle, creating, growing or merging tangles,
+//  and buffers the CZ between them; their frames are already up to date
+template <class real>
+void entangle( const qid_t qid1, const qid_t qid2, qmem_t<real>* qmem ) {
+    qubit_t<real> qubit_1 = find_own_qubit( qid1, qmem );
+    qubit_t<real> qubit_2 = find_own_qubit( qid2, qmem );
+    
+    if( invalid(qubit_1) )
+        if( invalid(qubit_2) ) {
+            // if both unknown, create new tangle with two |+> states
+            add_dual_tangle(qid1, qid2, qmem);
+            return; // already in correct state by construction
+        }
+        else
+            // add qid1 to qid2's tangle
+            add_qubit( qid1, qubit_2.tangle, qmem );
+        else
+            if( invalid(qubit_2) )
+                // add qid2 to qid1's tangle
+                add_qubit( qid2, qubit_1.tangle, qmem );
+            else
+                if( qubit_1.tangle != qubit_2.tangle )
+                    // both tangles are non-NULL, merge both
+                    merge_tangles(qubit_1.tangle, qubit_2.tangle, qmem);
+    // get valid qubit entries
+    qubit_1 = find_qubit( qid1, qmem );
+    qubit_2 = find_qubit( qid2, qmem );
     assert( qubit_1.tangle == qubit_2.tangle );
     
     /* printf("Performing CZ on qubits %d and %d on tangle ",  */
     /* 	 qubit_1.qid, qubit_2.qid); */
-    /* print_qids( qubit_1.tangle->qids ); */
+    /* print_qids( qubit_1.tangle ); */
     /* printf("\n"); */
-    /* printf("  calling cz with targets %d and %d\n, ", tar1, tar2); */
     
+    push_diagonal( qubit_1.tangle, qubit_1.pos, qubit_2.pos );
+}
 
-    if (_in_place_) {
-        quantum::controlled_z (tar1, tar2, qubit_1.tangle->qureg, qubit_1.tangle->qureg);
+// makes room for at least n deferred edges, keeping the current ones
+template <class real>
+void reserve_edges( qmem_t<real>* qmem, const qid_t n ) {
+    if( n <= qmem->edges_capacity )
+        return;
+    qid_t capacity = qmem->edges_capacity ? qmem->edges_capacity : MIN_TANGLE_CAPACITY;
+    while( capacity < n )
+        capacity <<= 1;
+    // (RE)ALLOC EDGE ARRAY
+    qmem->edges = (edge_t*) realloc(qmem->edges, capacity * sizeof(edge_t));
+    if( qmem->edges == NULL ) {
+        printf("ERROR: could not allocate room for %ld edges\n", capacity);
+        exit(EXIT_FAILURE);
     }
-    else {
-        quantum::quregister old_qureg = get_qureg(qubit_1);
-        qubit_1.tangle->qureg.reset();
-        quantum::controlled_z(tar1, tar2, old_qureg, qubit_1.tangle->qureg );
+    qmem->edges_capacity = capacity;
+}
+
+// E in lazy mode: the frames are updated now, the CZ is applied only when one
+//  of its qubits is measured (see entangle_edges); it commutes with all
+//  operators on other qubits, and with the diagonal ones on its own
+template <class real>
+void defer_edge( const qid_t qid_1, const qid_t qid_2, qmem_t<real>* qmem ) {
+    frame_cz( qid_1, qid_2, qmem );
+    reserve_edges( qmem, qmem->edges_size + 1 );
+    qmem->edges[qmem->edges_size++] = (edge_t){ qid_1, qid_2 };
+    qmem->qubits[qid_1].degree += 1;
+    qmem->qubits[qid_2].degree += 1;
+}
+
+// applies the deferred edges of a qubit
+template <class real>
+void entangle_edges( const qid_t qid, qmem_t<real>* qmem ) {
+    for( qid_t k=0 ; k < qmem->edges_size && qmem->qubits[qid].degree > 0 ; ) {
+        const edge_t edge = qmem->edges[k];
+        if( edge.a == qid || edge.b == qid ) {
+            qmem->edges[k] = qmem->edges[--qmem->edges_size];
+            qmem->qubits[edge.a].degree -= 1;
+            qmem->qubits[edge.b].degree -= 1;
+            entangle( edge.a, edge.b, qmem );
+        }
+        else
+            ++k;
     }
 }
 
-void qop_x( const qubit_t qubit ) {
-    assert( !invalid(qubit) );
-    quantum::quregister old_qureg = get_qureg(qubit);
-    qubit.tangle->qureg.reset();
-    quantum::sigma_x( get_target(qubit), old_qureg, qubit.tangle->qureg );
+// applies all deferred edges
+template <class real>
+void entangle_all( qmem_t<real>* qmem ) {
+    for( qid_t k=0 ; k < qmem->edges_size ; ++k ) {
+        const edge_t edge = qmem->edges[k];
+        qmem->qubits[edge.a].degree -= 1;
+        qmem->qubits[edge.b].degree -= 1;
+        entangle( edge.a, edge.b, qmem );
+    }
+    qmem->edges_size = 0;
 }
 
-void qop_z( const qubit_t qubit ) {
-    assert( !invalid(qubit) );
+// a qubit exists once it is in a tangle, or has deferred edges
+template <class real>
+bool known( const qid_t qid, const qmem_t<real>* qmem ) {
+    ensure_qid( qid );
+    return qmem->qubits[qid].tangle != NULL || qmem->qubits[qid].degree > 0;
+}
+
+// applies everything still owed, before the state is shown
+template <class real>
+void flush_qmem( qmem_t<real>* qmem ) {
+    entangle_all( qmem );
+    for( size_t i=0, tally=0 ; tally < qmem->size ; ++i ) {
+        assert(i<MAX_TANGLES);
+        if( qmem->tangles[i] ) {
+            flush_frame( own_tangle( qmem->tangles[i], qmem ), qmem );
+            ++tally;
+        }
+    }
+}
+
+/***************
+ ** EVALUATOR **
+ ***************/
+// the commands, once their arguments are known and their signals satisfied
+template <class real>
+void exec_E( const qid_t qid1, const qid_t qid2, qmem_t<real>* qmem ) {
+    ensure_qid( qid1 );
+    ensure_qid( qid2 );
+    if( _lazy_ ) {
+        defer_edge( qid1, qid2, qmem );
+        return;
+    }
+    frame_cz( qid1, qid2, qmem );
+    entangle( qid1, qid2, qmem );
+}
+
+// the uniform draw in [0, 1) deciding the outcome of measuring qid, in a
+//  shot (see SHOTS): a splitmix64 hash of the seed, the shot and the qid
+double draw( const qid_t qid, const uint64_t shot = 0 ) {
+    uint64_t x = _seed_ + ((shot << 16 | qid) + 1) * 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    x = x ^ (x >> 31);
+    return (x >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// the measurement is split in three: preparing the tangle of the qubit (which
+//  may fold its frame into the angle), projecting, and recording the outcome
+template <class real>
+qubit_t<real> prepare_M( const qid_t qid, double* angle, qmem_t<real>* qmem ) {
+    tangle_t<real>* tangle;
+    
+    //  printf("  Measuring qubits %d\n",qid);
+    
+    // apply the deferred edges of the qubit (lazy mode)
+    entangle_edges( qid, qmem );
+    
+    qubit_t<real> qubit = find_own_qubit( qid, qmem );
+    if( invalid(qubit) ) {
+        // create new qubit
+        tangle = add_tangle( qid, qmem );
+        qubit = find_qubit_in_tangle( qid, tangle );
+    }
+    // libquantum can only measure in ortho basis,
+    //  but <+|q = <0|Hq makes it diagonal
+    //  and <+_a| = <+|P_-a
+    if( _verbose_ )
+        printf("  measuring qubit %ld on angle %2.4f\n", qid, *angle);
+    /* printf("   before + correction:\n"); */
+    /* quantum_print_qureg( qubit.tangle->qureg ); */
+    
+    //  quantum_inv_phase_kick( get_target(qubit), angle, get_qureg(qubit) );
+    
+    // the pending operators on other qubits commute with the measurement
+    if( pending_on(qubit) )
+        flush_diagonal( qubit.tangle );
+    
+    // fold the Pauli frame of the qubit into the angle: Z adds PI, X mirrors
+    //  the angle and leaves the global phase -exp(-ia) on the tangle
+    const unsigned char frame = qmem->qubits[qid].frame;
+    if( frame & FRAME_X ) {
+        qubit.tangle->phase *= -std::exp(std::complex<double>(0, -*angle));
+        *angle = -*angle;
+    }
+    if( frame & FRAME_Z )
+        *angle += M_PI;
+    if( frame & FRAME_SIGN )
+        qubit.tangle->phase = -qubit.tangle->phase;
+    
+    return qubit;
+}
+
+// probability is that of the outcome when sampled, 0 when not
+template <class real>
+void record_M( const qubit_t<real> qubit, const int signal, const real probability, qmem_t<real>* qmem ) {
+    quantum::basic_quregister<real>& qureg = get_qureg(qubit);
+    // the register keeps its capacity, only give memory back
+    //  when most of it is unused
+    if( _in_place_ && qureg.size() <= qureg.capacity() / SHRINK_FACTOR )
+        qureg.shrink_to_fit();
+    
+    if( probability > 0 )
+        // the branch has norm 2p, renormalize along with the global phase
+        qubit.tangle->phase /= sqrt( 2 * (double)probability );
+    
+    /* printf("   result is %d\n",signal); */
+    set_signal( qubit.qid, signal, &qmem->signal_map );
+    
+    // remove measured qubit from memory
+    delete_qubit( qubit, qmem );
+}
+
+template <class real>
+void exec_M( const qid_t qid, double angle, qmem_t<real>* qmem ) {
+    int signal;
+    qubit_t<real> qubit = prepare_M( qid, &angle, qmem );
+    
+    // the probability of the outcome, when sampled
+    real probability = 0;
+    
     if (_in_place_) {
-        quantum::sigma_z( get_target(qubit), qubit.tangle->qureg, qubit.tangle->qureg);
+        quantum::basic_quregister<real>& qureg = get_qureg(qubit);
+        if( _random_ )
+            signal = quantum::backend<real>::sample( get_target(qubit),
+                                     angle, draw( qid ), probability,
+                                     qureg, qureg );
+        else
+            signal = quantum::backend<real>::measure( get_target(qubit),
+                                      angle,
+                                      qureg, qureg );
     }
     else {
-        quantum::quregister old_qureg = get_qureg(qubit);
+        quantum::basic_quregister<real> old_qureg = get_qureg(qubit);
         qubit.tangle->qureg.reset();
-        quantum::sigma_z( get_target(qubit), old_qureg, qubit.tangle->qureg );
+        if( _random_ )
+            signal = quantum::backend<real>::sample( get_target(qubit),
+                                     angle, draw( qid ), probability,
+                                     old_qureg, qubit.tangle->qureg );
+        else
+            signal = quantum::backend<real>::measure( get_target(qubit),
+                                      angle,
+                                      old_qureg, qubit.tangle->qureg );
     }
+    
+    if( _random_ )
+        ++_outcomes_[signal];
+    
+    record_M( qubit, signal, probability, qmem );
 }
 
-/***************
- ** EVALUATOR **
- ***************/
-void eval_E(sexp_t* exp, qmem_t* qmem) {
+template <class real>
+void exec_X( const qid_t qid, qmem_t<real>* qmem ) {
+    if( !known( qid, qmem ) )
+        // create new qubit
+        add_tangle( qid, qmem );
+    frame_x( qid, qmem );
+}
+
+template <class real>
+void exec_Z( const qid_t qid, qmem_t<real>* qmem ) {
+    if( !known( qid, qmem ) )
+        // create new qubit
+        add_tangle( qid, qmem );
+    frame_z( qid, qmem );
+}
+
+template <class real>
+void eval_E(sexp_t* exp, qmem_t<real>* qmem) {
     int qid1, qid2;
-    qubit_t qubit_1;
-    qubit_t qubit_2;
     
     assert( qmem );
     
@@ -689,42 +1335,14 @@ void eval_E(sexp_t* exp, qmem_t* qmem) {
     }
     qid2 = get_qid( exp );
     
-    // get tangle for qid1
-    qubit_1 = find_qubit( qid1, qmem );
-    qubit_2 = find_qubit( qid2, qmem );
-    
-    if( invalid(qubit_1) )
-        if( invalid(qubit_2) ) {
-            // if both unknown, create new tangle with two |+> states
-            add_dual_tangle(qid1, qid2, qmem);
-            return; // already in correct state by construction
-        }
-        else
-            // add qid1 to qid2's tangle
-            add_qubit( qid1, qubit_2.tangle );
-        else
-            if( invalid(qubit_2) )
-                // add qid2 to qid1's tangle
-                add_qubit( qid2, qubit_1.tangle );
-            else
-                if( qubit_1.tangle == qubit_2.tangle ) {
-                    // if not, qubit entries are already valid
-                    qop_cz( qubit_1, qubit_2 );
-                    return;
-                }
-                else
-                    // both tangles are non-NULL, merge both
-                    merge_tangles(qubit_1.tangle, qubit_2.tangle, qmem);
-    // get valid qubit entries
-    qubit_1 = find_qubit( qid1, qmem );
-    qubit_2 = find_qubit( qid2, qmem );
-    qop_cz( qubit_1, qubit_2 );
+    exec_E( qid1, qid2, qmem );
 }
 
 /* Parses and checks the value of the given signal(s) */
 /*   Syntax:  <identifier> | 0 | 1 | (q <qubit>) | (+ {<signal>}+ ) */
+template <class real>
 bool satisfy_signals( const sexp_t* exp,
-                     const qmem_t* qmem) {
+                     const qmem_t<real>* qmem) {
     const sexp_t* args;
     const sexp_t* first_arg;
     bool signal;
@@ -767,11 +1385,10 @@ bool satisfy_signals( const sexp_t* exp,
     exit(EXIT_FAILURE);
 }
 
-void eval_M(sexp_t* exp, qmem_t* qmem) {
+template <class real>
+void eval_M(sexp_t* exp, qmem_t<real>* qmem) {
     int qid;
     double angle = 0.0;
-    tangle_t* tangle;
-    int signal;
     assert( qmem );
     
     // move to the first argument
@@ -800,43 +1417,14 @@ void eval_M(sexp_t* exp, qmem_t* qmem) {
         }
     }
     
-    //  printf("  Measuring qubits %d\n",qid);
-    
-    qubit_t qubit = find_qubit( qid, qmem );
-    if( invalid(qubit) ) {
-        // create new qubit
-        tangle = add_tangle( qid, qmem );
-        qubit = find_qubit_in_tangle( qid, tangle );
-    }
-    // libquantum can only measure in ortho basis,
-    //  but <+|q = <0|Hq makes it diagonal
-    //  and <+_a| = <+|P_-a
-    if( _verbose_ )
-        printf("  measuring qubit %d on angle %2.4f\n", qid, angle);
-    /* printf("   before + correction:\n"); */
-    /* quantum_print_qureg( qubit.tangle->qureg ); */
-    
-    //  quantum_inv_phase_kick( get_target(qubit), angle, get_qureg(qubit) );
-    
-    quantum::quregister old_qureg = get_qureg(qubit);
-    qubit.tangle->qureg.reset();
-    signal = quantum::measure( get_target(qubit),
-                                      angle,
-                                      old_qureg, qubit.tangle->qureg );
-    
-    /* printf("   result is %d\n",signal); */
-    set_signal( qid, signal, &qmem->signal_map );
-    
-    // remove measured qubit from memory
-    delete_qubit( qubit, qmem );
-}
-
-
-void eval_X(sexp_t* exp, qmem_t* qmem) {
-    qid_t qid;
-    qubit_t qubit;
-    tangle_t* tangle;
-    assert( qmem );
+    exec_M( qid, angle, qmem );
+}
+
+
+template <class real>
+void eval_X(sexp_t* exp, qmem_t<real>* qmem) {
+    qid_t qid;
+    assert( qmem );
     
     // move to the first argument
     exp = cdr(exp);
@@ -854,19 +1442,12 @@ void eval_X(sexp_t* exp, qmem_t* qmem) {
             return;
     }
     
-    qubit = find_qubit( qid, qmem );
-    if( invalid(qubit) ) {
-        // create new qubit
-        tangle = add_tangle( qid, qmem );
-        qubit = find_qubit_in_tangle( qid, tangle );
-    }
-    qop_x( qubit );
+    exec_X( qid, qmem );
 }
 
-void eval_Z(sexp_t* exp, qmem_t* qmem) {
+template <class real>
+void eval_Z(sexp_t* exp, qmem_t<real>* qmem) {
     qid_t qid;
-    qubit_t qubit;
-    tangle_t* tangle;
     assert( qmem );
     
     // move to the first argument
@@ -885,98 +1466,1170 @@ void eval_Z(sexp_t* exp, qmem_t* qmem) {
             return;
     }
     
-    qubit = find_qubit( qid, qmem );
-    if( invalid(qubit) ) {
-        // create new qubit
-        tangle = add_tangle( qid, qmem );
-        qubit = find_qubit_in_tangle( qid, tangle );
-    }
-    qop_z( qubit );
+    exec_Z( qid, qmem );
 }
 
-// expects a list, evals the first argument and calls itself tail-recursively
-void eval( sexp_t* exp, qmem_t* qmem ) {
+// expects a list, evals its commands one after the other, in constant stack
+template <class real>
+void eval( sexp_t* exp, qmem_t<real>* qmem ) {
     CSTRING* str = snew(0);
     sexp_t* command;
-    sexp_t* rest;
     char opname;
     
     assert( qmem );
     
-    if( exp == NULL )
+    while( exp ) {
+        //ensure_list( exp );
+        if( exp->ty == SEXP_LIST ) {
+            command = car(exp);
+            if( _verbose_ ) {
+                print_sexp_cstr( &str, exp, STRING_SIZE );
+                printf("evaluating %s\n", toCharPtr(str));
+            }
+            exp = cdr(exp);
+        }
+        else {
+            assert( exp->ty == SEXP_VALUE );
+            command = exp;
+            sexp_t tmp_list = (sexp_t){SEXP_LIST, NULL, 0, 0, exp, NULL, SEXP_BASIC,
+                NULL, 0};
+            //    print_sexp_cstr( &str, new_sexp_list(exp), STRING_SIZE );
+            if( _verbose_ ) {
+                print_sexp_cstr( &str, &tmp_list, STRING_SIZE );
+                printf("evaluating %s\n", toCharPtr(str));
+            }
+            exp = NULL;
+        }
+        
+        opname = get_opname( command );
+        
+        switch ( opname ) {
+            case 'E':
+                eval_E( command, qmem );
+                break;
+            case 'M':
+                eval_M( command, qmem );
+                break;
+            case 'X':
+                eval_X( command, qmem );
+                break;
+            case 'Z':
+                eval_Z( command, qmem );
+                break;
+            default:
+                printf("unknown command: %c\n", opname);
+                sdestroy( str );
+                return;
+        }
+        if( _verbose_ )
+            print_qmem(qmem);
+    }
+    
+    sdestroy( str );
+}
+
+/***************
+ ** SCHEDULER **
+ ***************/
+// the commands of a program may run in any order that keeps, per qubit, the
+//  order of the operators that do not commute (E and Z commute, X commutes
+//  with X, M with nothing), and measures a qubit before its signal is used
+// the scheduler picks such an order to keep the tangles small: measurements
+//  and corrections run as soon as they are ready, entanglement only when
+//  the earliest measurement that depends on it is next
+
+#define PHASE_DIAGONAL 0
+#define PHASE_X        1
+#define PHASE_M        2
+
+// the operators on a qubit, in phases of commuting operators
+struct qubit_phases_t {
+    int kind;
+    std::vector<int> previous;
+    std::vector<int> current;
+};
+
+// collects the qids of the signals in a signal expression
+//  (see satisfy_signals for the syntax)
+void signal_qids( const sexp_t* exp, std::vector<qid_t>& qids ) {
+    if( exp->ty != SEXP_LIST )
+        return;
+    const sexp_t* args = exp->list;
+    if( args->ty != SEXP_VALUE || !args->next )
         return;
+    if( strcmp(args->val, "q")==0 ||
+       strcmp(args->val, "Q")==0 ||
+       strcmp(args->val, "s")==0 ||
+       strcmp(args->val, "S")==0 )
+        qids.push_back( atoi(args->next->val) );
+    else
+        if( strcmp(args->val, "+")==0 )
+            for( const sexp_t* arg=args->next; arg; arg=arg->next )
+                signal_qids( arg, qids );
+}
+
+// reorders the commands of a program (relinking them), returns the first
+//  an unexpected command leaves the program as it is, for eval to report
+sexp_t* schedule( sexp_t* program ) {
+    std::vector<sexp_t*> commands;
+    for( sexp_t* exp=program ; exp ; exp=cdr(exp) ) {
+        if( exp->ty != SEXP_LIST || !car(exp) || car(exp)->ty != SEXP_VALUE )
+            return program;
+        commands.push_back( exp );
+    }
+    const int n = commands.size();
+    if( n == 0 )
+        return program;
+    
+    std::vector< std::vector<int> > successors( n );
+    std::vector<int> predecessors( n, 0 );
+    std::vector<qubit_phases_t> phases( MAX_QUBITS );
+    std::vector<int> measured( MAX_QUBITS, -1 );
+    for( qid_t qid=0 ; qid<MAX_QUBITS ; ++qid )
+        phases[qid].kind = -1;
+    
+    // build the dependencies
+    for( int c=0 ; c<n ; ++c ) {
+        const sexp_t* command = car(commands[c]);
+        const sexp_t* args = cdr(command);
+        std::vector<qid_t> qids, signals;
+        int kind;
+        if( !args )
+            return program;
+        qids.push_back( get_qid((sexp_t*)args) );
+        switch( get_opname((sexp_t*)command) ) {
+            case 'E':
+                if( !args->next )
+                    return program;
+                qids.push_back( get_qid(args->next) );
+                kind = PHASE_DIAGONAL;
+                break;
+            case 'M':
+                // the s- and t-signals follow the angle
+                if( args->next )
+                    for( const sexp_t* signal=args->next->next; signal; signal=signal->next )
+                        signal_qids( signal, signals );
+                kind = PHASE_M;
+                break;
+            case 'X':
+            case 'Z':
+                if( args->next )
+                    signal_qids( args->next, signals );
+                kind = get_opname((sexp_t*)command) == 'X' ? PHASE_X : PHASE_DIAGONAL;
+                break;
+            default:
+                return program;
+        }
+        
+        for( size_t k=0 ; k<qids.size() ; ++k ) {
+            ensure_qid( qids[k] );
+            qubit_phases_t& qubit = phases[qids[k]];
+            if( qubit.kind != kind || kind == PHASE_M ) {
+                // a new phase, after all operators of the current one
+                qubit.previous.swap( qubit.current );
+                qubit.current.clear();
+                qubit.kind = kind;
+            }
+            qubit.current.push_back( c );
+            for( size_t p=0 ; p<qubit.previous.size() ; ++p ) {
+                successors[qubit.previous[p]].push_back( c );
+                predecessors[c] += 1;
+            }
+        }
+        for( size_t k=0 ; k<signals.size() ; ++k ) {
+            ensure_qid( signals[k] );
+            if( measured[signals[k]] >= 0 ) {
+                successors[measured[signals[k]]].push_back( c );
+                predecessors[c] += 1;
+            }
+        }
+        if( kind == PHASE_M )
+            measured[qids[0]] = c;
+    }
+    
+    // the earliest measurement depending on each command, n when none
+    std::vector<int> urgency( n, n );
+    for( int c=n-1 ; c>=0 ; --c ) {
+        if( get_opname(car(commands[c])) == 'M' )
+            urgency[c] = c;
+        for( size_t k=0 ; k<successors[c].size() ; ++k )
+            urgency[c] = std::min( urgency[c], urgency[successors[c][k]] );
+    }
+    
+    // list the ready commands: measurements and corrections first, then by
+    //  urgency, then in program order
+    std::priority_queue< long, std::vector<long>, std::greater<long> > ready;
+    #define SCHEDULE_KEY(c) \
+        (((long)(get_opname(car(commands[c])) == 'E') << 62) | ((long)urgency[c] << 31) | (long)(c))
+    for( int c=0 ; c<n ; ++c )
+        if( predecessors[c] == 0 )
+            ready.push( SCHEDULE_KEY(c) );
+    
+    sexp_t* first = NULL;
+    sexp_t* last = NULL;
+    int scheduled = 0;
+    while( !ready.empty() ) {
+        const int c = ready.top() & INT_MAX;
+        ready.pop();
+        if( last )
+            last->next = commands[c];
+        else
+            first = commands[c];
+        last = commands[c];
+        ++scheduled;
+        for( size_t k=0 ; k<successors[c].size() ; ++k )
+            if( --predecessors[successors[c][k]] == 0 )
+                ready.push( SCHEDULE_KEY(successors[c][k]) );
+    }
+    #undef SCHEDULE_KEY
+    assert( scheduled == n );
+    last->next = NULL;
+    return first;
+}
+
+/**************
+ ** BYTECODE **
+ **************/
+// a program is compiled once into a flat array of decoded instructions: qids
+//  and angles are parsed, angle constants resolved, and every signal
+//  expression is flattened into the xor of a constant and a list of signals
+
+// constant ^ signal(signals[first]) ^ ... ^ signal(signals[first+size-1])
+typedef struct signal_expr {
+    bool constant;
+    qid_t first;
+    qid_t size;
+} signal_expr_t;
+
+typedef struct instruction {
+    char opname;        // E, M, X or Z
+    qid_t qid1;
+    qid_t qid2;         // E only
+    double angle;       // M only
+    signal_expr_t s;    // M: s-signal, flips the angle; X, Z: condition
+    signal_expr_t t;    // M: t-signal, adds PI to the angle
+} instruction_t;
+
+typedef struct program {
+    qid_t size;
+    qid_t capacity;
+    instruction_t* code;
+    qid_t signals_size;
+    qid_t signals_capacity;
+    qid_t* signals;     // the qids of all signal expressions
+} program_t;
+
+program_t* init_program() {
+    program_t* program = (program_t*) malloc(sizeof(program_t)); //ALLOC program
+    program->size = 0;
+    program->capacity = 0;
+    program->code = NULL;
+    program->signals_size = 0;
+    program->signals_capacity = 0;
+    program->signals = NULL;
+    return program;
+}
+
+void free_program( program_t* program ) {
+    free( program->code ); //FREE code
+    free( program->signals ); //FREE signals
+    free( program ); //FREE program
+}
+
+// make room for at least n instructions, keeping the current ones
+void reserve_code( program_t* program, const qid_t n ) {
+    if( n <= program->capacity )
+        return;
+    qid_t capacity = program->capacity ? program->capacity : MIN_TANGLE_CAPACITY;
+    while( capacity < n )
+        capacity <<= 1;
+    // (RE)ALLOC CODE ARRAY
+    program->code = (instruction_t*) realloc(program->code, capacity * sizeof(instruction_t));
+    if( program->code == NULL ) {
+        printf("ERROR: could not allocate room for %ld instructions\n", capacity);
+        exit(EXIT_FAILURE);
+    }
+    program->capacity = capacity;
+}
+
+// make room for at least n signal qids, keeping the current ones
+void reserve_signals( program_t* program, const qid_t n ) {
+    if( n <= program->signals_capacity )
+        return;
+    qid_t capacity = program->signals_capacity ? program->signals_capacity : MIN_TANGLE_CAPACITY;
+    while( capacity < n )
+        capacity <<= 1;
+    // (RE)ALLOC SIGNAL ARRAY
+    program->signals = (qid_t*) realloc(program->signals, capacity * sizeof(qid_t));
+    if( program->signals == NULL ) {
+        printf("ERROR: could not allocate room for %ld signals\n", capacity);
+        exit(EXIT_FAILURE);
+    }
+    program->signals_capacity = capacity;
+}
+
+// appends the signals of exp to the program, and xors its constants into
+//  constant (see satisfy_signals for the syntax)
+void compile_signal_terms( const sexp_t* exp, program_t* program, bool* constant ) {
+    const sexp_t* args;
+    CSTRING* str = NULL;
     
-    //ensure_list( exp );
     if( exp->ty == SEXP_LIST ) {
-        command = car(exp);
-        rest = cdr(exp);
-        if( _verbose_ ) {
-            print_sexp_cstr( &str, exp, STRING_SIZE );
-            printf("evaluating %s\n", toCharPtr(str));
-        }
+        args = exp->list;
+        if( args->ty == SEXP_VALUE ) {
+            if( strcmp(args->val, "q")==0 ||
+               strcmp(args->val, "Q")==0 ||
+               strcmp(args->val, "s")==0 ||
+               strcmp(args->val, "S")==0) {
+                reserve_signals( program, program->signals_size + 1 );
+                program->signals[program->signals_size++] = atoi(args->next->val);
+                return;
+            }
+            else
+                if( strcmp(args->val, "+")==0 ) {
+                    for(const sexp_t* arg=args->next; arg; arg=arg->next)
+                        compile_signal_terms( arg, program, constant );
+                    return;
+                }
+        }// otherwise, fall through to parse_error
     }
-    else {
-        assert( exp->ty == SEXP_VALUE );
-        command = exp;
-        rest = NULL;
-        sexp_t tmp_list = (sexp_t){SEXP_LIST, NULL, 0, 0, exp, NULL, SEXP_BASIC,
-            NULL, 0};
-        //    print_sexp_cstr( &str, new_sexp_list(exp), STRING_SIZE );
-        if( _verbose_ ) {
-            print_sexp_cstr( &str, &tmp_list, STRING_SIZE );
-            printf("evaluating %s\n", toCharPtr(str));
-        }
+    else
+        if( exp->ty == SEXP_VALUE ) {
+            if( strcmp(exp->val, "0") == 0 )
+                return;
+            if( strcmp(exp->val, "1") == 0 ) {
+                *constant = !*constant;
+                return;
+            }
+        } // otherwise, fall through to parse_error
+    
+    print_sexp_cstr( &str, exp, STRING_SIZE );
+    printf("ERROR: I got confused parsing signal: %s\n", toCharPtr( str ));
+    printf("  signal syntax:  <identifier> | 0 | 1 | (q <qubit>) |"
+           " (+ {<signal>}+ )\n");
+    sdestroy(str);
+    exit(EXIT_FAILURE);
+}
+
+// a missing signal expression is the constant 'otherwise'
+signal_expr_t compile_signal( const sexp_t* exp, program_t* program, bool otherwise ) {
+    signal_expr_t signal = { otherwise, program->signals_size, 0 };
+    if( exp ) {
+        signal.constant = false;
+        compile_signal_terms( exp, program, &signal.constant );
+        signal.size = program->signals_size - signal.first;
     }
+    return signal;
+}
+
+// compiles one command to the end of the program, false if it is unknown
+bool compile_command( sexp_t* command, program_t* program ) {
+    sexp_t* args = cdr(command);
+    instruction_t ins = { get_opname(command), 0, 0, 0.0,
+        { false, 0, 0 }, { false, 0, 0 } };
     
-    opname = get_opname( command );
+    switch( ins.opname ) {
+        case 'E':
+            if( !args ) {
+                printf("Entangle did not have any qubit arguments");
+                exit(EXIT_FAILURE);
+            }
+            if( !cdr(args) ) {
+                printf("Entangle did not have a second argument");
+                exit(EXIT_FAILURE);
+            }
+            ins.qid1 = get_qid( args );
+            ins.qid2 = get_qid( cdr(args) );
+            ensure_qid( ins.qid2 );
+            break;
+        case 'M':
+            if( !args ) {
+                printf("Measurement did not have any target qubit argument\n");
+                exit(EXIT_FAILURE);
+            }
+            ins.qid1 = get_qid( args );
+            args = cdr(args);
+            if( args ) { // default is 0
+                ins.angle = parse_angle( args );
+                args = cdr(args);
+            }
+            ins.s = compile_signal( args, program, false );
+            ins.t = compile_signal( args ? cdr(args) : NULL, program, false );
+            break;
+        case 'X':
+        case 'Z':
+            if( !args ) {
+                printf("%c-correction did not have any target qubit argument\n",
+                       ins.opname);
+                exit(EXIT_FAILURE);
+            }
+            ins.qid1 = get_qid( args );
+            ins.s = compile_signal( cdr(args), program, true );
+            break;
+        default:
+            printf("unknown command: %c\n", ins.opname);
+            return false;
+    }
+    ensure_qid( ins.qid1 );
     
-    sdestroy( str );
+    reserve_code( program, program->size + 1 );
+    program->code[program->size++] = ins;
+    return true;
+}
+
+// compiles a list of commands, stops at an unknown command like eval
+program_t* compile( sexp_t* exp ) {
+    program_t* program = init_program();
     
-    switch ( opname ) {
+    while( exp ) {
+        sexp_t* command;
+        if( exp->ty == SEXP_LIST ) {
+            command = car(exp);
+            exp = cdr(exp);
+        }
+        else { // a single command, as in eval
+            command = exp;
+            exp = NULL;
+        }
+        if( !compile_command( command, program ) )
+            break;
+    }
+    return program;
+}
+
+void print_instruction( const instruction_t* ins ) {
+    switch( ins->opname ) {
         case 'E':
-            eval_E( command, qmem );
-            if( _verbose_ )
-                print_qmem(qmem);
-            eval( rest, qmem );
+            printf("(E %ld %ld)\n", ins->qid1, ins->qid2);
             break;
         case 'M':
-            eval_M( command, qmem );
-            if( _verbose_ )
-                print_qmem(qmem);
-            eval( rest, qmem );
+            printf("(M %ld %f)\n", ins->qid1, ins->angle);
+            break;
+        default:
+            printf("(%c %ld)\n", ins->opname, ins->qid1);
+    }
+}
+
+template <class real>
+bool signal_value( const program_t* program,
+                  const signal_expr_t* signal,
+                  const qmem_t<real>* qmem ) {
+    bool value = signal->constant;
+    for( qid_t k=0 ; k < signal->size ; ++k )
+        value ^= get_signal( program->signals[signal->first + k], &qmem->signal_map );
+    return value;
+}
+
+// the angle of an M instruction, with its signals
+template <class real>
+double instruction_angle( const program_t* program,
+                         const instruction_t* ins,
+                         const qmem_t<real>* qmem ) {
+    double angle = ins->angle;
+    if( signal_value(program, &ins->s, qmem) )
+        angle = -angle;
+    if( signal_value(program, &ins->t, qmem) )
+        angle += M_PI;
+    return angle;
+}
+
+template <class real>
+void exec_instruction( const program_t* program,
+                      const instruction_t* ins,
+                      qmem_t<real>* qmem ) {
+    switch( ins->opname ) {
+        case 'E':
+            exec_E( ins->qid1, ins->qid2, qmem );
+            break;
+        case 'M':
+            exec_M( ins->qid1, instruction_angle(program, ins, qmem), qmem );
             break;
         case 'X':
-            eval_X( command, qmem );
-            if( _verbose_ )
-                print_qmem(qmem);
-            eval( rest, qmem );
+            if( signal_value(program, &ins->s, qmem) )
+                exec_X( ins->qid1, qmem );
             break;
         case 'Z':
-            eval_Z( command, qmem );
-            if( _verbose_ )
-                print_qmem(qmem);
-            eval( rest, qmem );
+            if( signal_value(program, &ins->s, qmem) )
+                exec_Z( ins->qid1, qmem );
             break;
-        default:
-            printf("unknown command: %c\n", opname);
     }
 }
 
-quantum::complex parse_complex( const char* str ) {
+/************
+ ** LAYOUT **
+ ************/
+// with -L, the qubits a tangle is about to measure move to its highest
+//  targets (the front of its qids), in the order of their measurements, in
+//  one pass over the register (permute). The blocks backend measures high
+//  targets on two contiguous halves of the register, and low ones on many
+//  short runs, in several rounds when in place.
+// The pass costs about two measurements, so a tangle is only laid out when
+//  it is larger than the caches (LAYOUT_QUBITS qubits or more), and at least
+//  LAYOUT_BATCH of its qubits below LAYOUT_TARGET are measured in the next
+//  LAYOUT_WINDOW instructions, the first one next. Only those qubits move, the
+//  others keep their order behind them. The qubits stay in front as others
+//  are measured, or appended by E.
+// Only the sequential loops lay tangles out, so -L does not run with -c.
+
+#define LAYOUT_QUBITS (qid_t)16
+#define LAYOUT_TARGET (pos_t)8
+#define LAYOUT_BATCH (qid_t)6
+#define LAYOUT_WINDOW (qid_t)512
+
+// lays out the tangle of the qubit that instruction pc measures
+template <class real>
+void layout_tangle( const program_t* program, const qid_t pc, qmem_t<real>* qmem ) {
+    qubit_t<real> qubit = find_qubit( program->code[pc].qid1, qmem );
+    if( invalid(qubit) || qubit.tangle->size < LAYOUT_QUBITS ||
+       get_target(qubit) >= LAYOUT_TARGET )
+        return;
+    
+    // the new position of each position: the measured qubits first
+    const qid_t size = qubit.tangle->size;
+    std::vector<pos_t> to( size, size );
+    pos_t next = 0;
+    for( qid_t k=pc ; k < program->size && k < pc + LAYOUT_WINDOW ; ++k ) {
+        const instruction_t* ins = &program->code[k];
+        if( ins->opname != 'M' )
+            continue;
+        const qubit_entry_t<real>* entry = &qmem->qubits[ins->qid1];
+        if( entry->tangle == qubit.tangle && to[entry->pos] == size &&
+           size - entry->pos - 1 < LAYOUT_TARGET )
+            to[entry->pos] = next++;
+    }
+    if( next < LAYOUT_BATCH )
+        return;
+    for( pos_t pos=0 ; pos < size ; ++pos )
+        if( to[pos] == size )
+            to[pos] = next++;
+    
+    tangle_t<real>* tangle = own_tangle( qubit.tangle, qmem );
+    
+    // position pos is target size - pos - 1
+    std::vector<quantum::size_type> map( size );
+    for( pos_t pos=0 ; pos < size ; ++pos )
+        map[size - pos - 1] = size - to[pos] - 1;
+    if (_in_place_) {
+        quantum::backend<real>::permute( &map[0], tangle->qureg, tangle->qureg );
+    }
+    else {
+        quantum::basic_quregister<real> old_qureg = tangle->qureg;
+        tangle->qureg.reset();
+        quantum::backend<real>::permute( &map[0], old_qureg, tangle->qureg );
+    }
+    
+    std::vector<qid_t> qids( tangle->qids, tangle->qids + size );
+    for( pos_t pos=0 ; pos < size ; ++pos )
+        tangle->qids[to[pos]] = qids[pos];
+    for( qid_t k=0 ; k < tangle->pending_size ; ++k ) {
+        diagonal_op_t* op = &tangle->pending[k];
+        op->a = to[op->a];
+        op->b = to[op->b];
+    }
+    index_qids( tangle, 0, qmem );
+}
+
+/****************
+ ** CONCURRENT **
+ ****************/
+// with -c, instructions on different tangles run concurrently. The tangles
+//  are followed ahead of time: groups of qubits, starting from the tangles in
+//  qmem, that merge on E like the tangles do. An instruction depends on
+//   - the previous instruction on its group (on both groups, for E)
+//   - the measurements of the signals it reads
+//  and the instructions run as TBB tasks once their dependencies are done, in
+//  the arena of the parallel operators: the threads a small tangle cannot
+//  use go to the instructions on the other tangles.
+
+// successors[first[i] .. first[i+1]) depend on instruction i, which waits
+//  for pending[i] instructions
+// the groups are kept, with the slots their tangles take in qmem->tangles
+//  when the program runs sequentially, to put the tangles back in that order
+typedef struct task_graph {
+    std::vector<qid_t> first;
+    std::vector<qid_t> successors;
+    std::vector<std::atomic<qid_t> > pending;
+    std::vector<long> group;    // of each qid, -1 if not in any tangle
+    std::vector<long> parent;   // union-find of the groups
+    std::vector<int> slot;      // per group
+    qid_t width;                // of the widest tangle
+} task_graph_t;
+
+long find_group( std::vector<long>& parent, long group ) {
+    while( parent[group] != group ) {
+        parent[group] = parent[parent[group]];
+        group = parent[group];
+    }
+    return group;
+}
+
+template <class real>
+void build_task_graph( const program_t* program,
+                      const qmem_t<real>* qmem,
+                      task_graph_t* graph ) {
+    std::vector<long>& group = graph->group;
+    std::vector<long>& parent = graph->parent;
+    std::vector<int>& slot = graph->slot;
+    std::vector<long> measured( MAX_QUBITS, -1 );   // instruction, in this program
+    std::vector<long> last;                         // instruction, per group
+    std::vector<qid_t> size;                        // qubits, per group
+    std::vector<bool> used( MAX_TANGLES, false );   // slots
+    std::vector<std::pair<qid_t, qid_t> > edges;    // (instruction, successor)
+    
+    group.assign( MAX_QUBITS, -1 );
+    graph->width = 0;
+    // a new tangle takes the first free slot, as in get_free_tangle
+    auto new_group = [&]( int s ) {
+        while( used[s] )
+            ++s;
+        used[s] = true;
+        parent.push_back( parent.size() );
+        last.push_back( -1 );
+        size.push_back( 0 );
+        slot.push_back( s );
+        return (long)parent.size() - 1;
+    };
+    
+    // the tangles in qmem are the first groups
+    for( size_t i=0, tally=0 ; tally < qmem->size ; ++i ) {
+        const tangle_t<real>* tangle = qmem->tangles[i];
+        if( tangle ) {
+            long g = new_group( i );
+            for( qid_t k=0 ; k < tangle->size ; ++k )
+                group[tangle->qids[k]] = g;
+            size[g] = tangle->size;
+            if( size[g] > graph->width )
+                graph->width = size[g];
+            ++tally;
+        }
+    }
+    
+    for( qid_t pc=0 ; pc < program->size ; ++pc ) {
+        const instruction_t* ins = &program->code[pc];
+        const qid_t a = ins->qid1;
+        const qid_t b = ins->qid2;
+        long g;
+        if( ins->opname == 'E' ) {  // as in entangle
+            if( group[a] < 0 && group[b] < 0 ) {
+                g = group[a] = group[b] = new_group( 0 );
+                size[g] = 2;
+            }
+            else if( group[a] < 0 || group[b] < 0 ) {
+                g = find_group( parent, group[a] < 0 ? group[b] : group[a] );
+                group[a] = group[b] = g;
+                size[g] += 1;
+            }
+            else {
+                g = find_group( parent, group[a] );
+                long h = find_group( parent, group[b] );
+                if( h != g ) {  // the tangle of b merges into the one of a
+                    if( last[h] >= 0 )
+                        edges.push_back( std::make_pair(last[h], pc) );
+                    parent[h] = g;
+                    size[g] += size[h];
+                    used[slot[h]] = false;
+                }
+            }
+        }
+        else {
+            if( group[a] < 0 ) {
+                group[a] = new_group( 0 );
+                size[group[a]] = 1;
+            }
+            g = find_group( parent, group[a] );
+        }
+        if( last[g] >= 0 )
+            edges.push_back( std::make_pair(last[g], pc) );
+        last[g] = pc;
+        if( size[g] > graph->width )
+            graph->width = size[g];
+        
+        const signal_expr_t* signals[2] = { &ins->s, &ins->t };
+        for( int s=0 ; s < (ins->opname == 'M' ? 2 : 1) ; ++s )
+            for( qid_t k=0 ; k < signals[s]->size ; ++k ) {
+                long m = measured[program->signals[signals[s]->first + k]];
+                if( m >= 0 )
+                    edges.push_back( std::make_pair(m, pc) );
+            }
+        
+        if( ins->opname == 'M' ) {
+            measured[a] = pc;
+            group[a] = -1;  // the next use is a new qubit
+            if( --size[g] == 0 )
+                used[slot[g]] = false;
+        }
+    }
+    
+    // sort the edges by instruction (they are already sorted by successor)
+    graph->first.assign( program->size + 1, 0 );
+    graph->successors.resize( edges.size() );
+    graph->pending = std::vector<std::atomic<qid_t> >( program->size );
+    for( size_t e=0 ; e < edges.size() ; ++e ) {
+        graph->first[edges[e].first + 1] += 1;
+        graph->pending[edges[e].second] += 1;
+    }
+    for( qid_t pc=0 ; pc < program->size ; ++pc )
+        graph->first[pc + 1] += graph->first[pc];
+    std::vector<qid_t> next( graph->first.begin(), graph->first.end() - 1 );
+    for( size_t e=0 ; e < edges.size() ; ++e )
+        graph->successors[next[edges[e].first]++] = edges[e].second;
+}
+
+// puts the tangles in the slots they have after a sequential run, so the
+//  output does not depend on the order the tasks ran in
+template <class real>
+void restore_layout( task_graph_t* graph, qmem_t<real>* qmem ) {
+    for( size_t i=0, tally=0 ; tally < qmem->size ; ++i )
+        if( qmem->tangles[i] ) {
+            qmem->tangles[i] = NULL;
+            ++tally;
+        }
+    for( qid_t qid=0 ; qid < MAX_QUBITS ; ++qid )
+        if( graph->group[qid] >= 0 ) {
+            int s = graph->slot[find_group( graph->parent, graph->group[qid] )];
+            assert( qmem->tangles[s] == NULL ||
+                   qmem->tangles[s] == qmem->qubits[qid].tangle );
+            qmem->tangles[s] = qmem->qubits[qid].tangle;
+        }
+}
+
+// runs instruction pc, then the instructions it was the last dependency of:
+//  the first one in this task, the others in new tasks
+template <class real>
+void run_task( const program_t* program,
+              task_graph_t* graph,
+              qid_t pc,
+              qmem_t<real>* qmem,
+              tbb::task_group* tasks ) {
+    for( ;; ) {
+        exec_instruction( program, &program->code[pc], qmem );
+        long next = -1;
+        for( qid_t k = graph->first[pc] ; k < graph->first[pc + 1] ; ++k ) {
+            qid_t successor = graph->successors[k];
+            if( --graph->pending[successor] == 0 ) {
+                if( next < 0 )
+                    next = successor;
+                else
+                    tasks->run( [=]{ run_task( program, graph, successor, qmem, tasks ); } );
+            }
+        }
+        if( next < 0 )
+            return;
+        pc = next;
+    }
+}
+
+template <class real>
+void execute_concurrent( const program_t* program, qmem_t<real>* qmem ) {
+    task_graph_t graph;
+    build_task_graph( program, qmem, &graph );
+    
+    tbb::task_group tasks;
+    for( qid_t pc=0 ; pc < program->size ; ++pc )
+        if( graph.pending[pc] == 0 )
+            tasks.run( [=, &graph, &tasks]{ run_task( program, &graph, pc, qmem, &tasks ); } );
+    tasks.wait();
+    restore_layout( &graph, qmem );
+}
+
+// runs a compiled program
+template <class real>
+void execute( const program_t* program, qmem_t<real>* qmem ) {
+    assert( qmem );
+    // lazy mode shares the deferred edges between all tangles
+    if( _concurrent_ && !_lazy_ && !_verbose_ ) {
+        execute_concurrent( program, qmem );
+        return;
+    }
+    for( qid_t pc=0 ; pc < program->size ; ++pc ) {
+        const instruction_t* ins = &program->code[pc];
+        if( _verbose_ ) {
+            printf("executing ");
+            print_instruction( ins );
+        }
+        if( _layout_ && ins->opname == 'M' )
+            layout_tangle( program, pc, qmem );
+        exec_instruction( program, ins, qmem );
+        if( _verbose_ )
+            print_qmem(qmem);
+    }
+}
+
+/*********************
+ ** BINARY PROGRAMS **
+ *********************/
+// a compiled program is saved as a header followed by its instructions,
+//  packed: an opcode byte and the operands of that opcode, qids in 32 bits,
+//  and every signal expression inline as its constant and its list of qids
+//
+//  +--------+-------------+-------------+-----+
+//  | header | instruction | instruction | ... |   size instructions
+//  +--------+-------------+-------------+-----+
+//
+//    E        'E' qid1 qid2                   9 bytes
+//    M        'M' qid1 angle s t             23 bytes, and 4 per signal qid
+//    X, Z     'X' qid1 s                     10 bytes, and 4 per signal qid
+//    signal   constant (1 byte), size (32 bits), size qids
+//
+// loading maps the file and decodes it into the code and signals arrays,
+//  checking every opcode, qid and length: a damaged or crafted file is
+//  refused, it cannot reach past the qubit table or the signals. Fields are
+//  in the byte order of the machine that wrote them.
+
+#define MCB_MAGIC "PQVMMCB"
+#define MCB_VERSION 2
+
+typedef struct mcb_header {
+    char magic[8];
+    uint32_t version;
+    uint64_t size;          // instructions
+    uint64_t signals_size;  // signal qids, over all instructions
+} mcb_header_t;
+
+// a cursor over a mapped file
+typedef struct mcb_reader {
+    const char* at;
+    const char* end;
+} mcb_reader_t;
+
+// is this the name of a compiled program?
+bool is_mcb( const char* file ) {
+    size_t length = strlen( file );
+    return length > 4 && strcmp( file + length - 4, ".mcb" ) == 0;
+}
+
+bool mcb_write( FILE* out, const void* value, const size_t bytes ) {
+    return fwrite( value, bytes, 1, out ) == 1;
+}
+
+bool mcb_write_qid( FILE* out, const qid_t qid ) {
+    uint32_t q = qid;
+    return mcb_write( out, &q, sizeof(q) );
+}
+
+bool mcb_write_signal( FILE* out, const program_t* program, const signal_expr_t* signal ) {
+    uint8_t constant = signal->constant;
+    uint32_t size = signal->size;
+    bool ok = mcb_write( out, &constant, sizeof(constant) ) &&
+              mcb_write( out, &size, sizeof(size) );
+    for( qid_t k=0 ; ok && k<signal->size ; ++k )
+        ok = mcb_write_qid( out, program->signals[signal->first + k] );
+    return ok;
+}
+
+// false when the read runs past the end of the file
+bool mcb_read( mcb_reader_t* in, void* value, const size_t bytes ) {
+    if( (size_t)(in->end - in->at) < bytes )
+        return false;
+    memcpy( value, in->at, bytes );
+    in->at += bytes;
+    return true;
+}
+
+// false for a qid out of range as well
+bool mcb_read_qid( mcb_reader_t* in, qid_t* qid ) {
+    uint32_t q;
+    if( !mcb_read( in, &q, sizeof(q) ) || q >= MAX_QUBITS )
+        return false;
+    *qid = q;
+    return true;
+}
+
+// appends the qids of the signal to the program
+bool mcb_read_signal( mcb_reader_t* in, program_t* program, signal_expr_t* signal ) {
+    uint8_t constant;
+    uint32_t size;
+    if( !mcb_read( in, &constant, sizeof(constant) ) || constant > 1 ||
+       !mcb_read( in, &size, sizeof(size) ) ||
+       size > (size_t)(in->end - in->at) / sizeof(uint32_t) )
+        return false;
+    signal->constant = constant;
+    signal->first = program->signals_size;
+    signal->size = size;
+    reserve_signals( program, program->signals_size + size );
+    for( uint32_t k=0 ; k<size ; ++k )
+        if( !mcb_read_qid( in, &program->signals[program->signals_size++] ) )
+            return false;
+    return true;
+}
+
+void save_program( const program_t* program, const char* file ) {
+    mcb_header_t header;
+    memset( &header, 0, sizeof(header) );
+    memcpy( header.magic, MCB_MAGIC, sizeof(header.magic) );
+    header.version = MCB_VERSION;
+    header.size = program->size;
+    for( qid_t pc=0 ; pc<program->size ; ++pc )
+        header.signals_size += program->code[pc].s.size + program->code[pc].t.size;
+    
+    FILE* out = fopen( file, "wb" );
+    if( !out ) {
+        fprintf( stderr, "ERROR: cannot write program to %s\n", file );
+        exit(EXIT_FAILURE);
+    }
+    bool ok = mcb_write( out, &header, sizeof(header) );
+    for( qid_t pc=0 ; ok && pc<program->size ; ++pc ) {
+        const instruction_t* ins = &program->code[pc];
+        uint8_t opname = ins->opname;
+        ok = mcb_write( out, &opname, sizeof(opname) ) &&
+             mcb_write_qid( out, ins->qid1 );
+        switch( ins->opname ) {
+            case 'E':
+                ok = ok && mcb_write_qid( out, ins->qid2 );
+                break;
+            case 'M':
+                ok = ok && mcb_write( out, &ins->angle, sizeof(ins->angle) ) &&
+                     mcb_write_signal( out, program, &ins->s ) &&
+                     mcb_write_signal( out, program, &ins->t );
+                break;
+            default:
+                ok = ok && mcb_write_signal( out, program, &ins->s );
+                break;
+        }
+    }
+    if( fclose( out ) != 0 || !ok ) {
+        fprintf( stderr, "ERROR: cannot write program to %s\n", file );
+        exit(EXIT_FAILURE);
+    }
+}
+
+program_t* load_program( const char* file ) {
+    int fd = open( file, O_RDONLY );
+    struct stat st;
+    if( fd < 0 || fstat( fd, &st ) != 0 ) {
+        fprintf( stderr, "ERROR: cannot open program %s\n", file );
+        exit(EXIT_FAILURE);
+    }
+    size_t length = st.st_size;
+    if( length < sizeof(mcb_header_t) ) {
+        fprintf( stderr, "ERROR: %s is not a compiled program\n", file );
+        exit(EXIT_FAILURE);
+    }
+    void* map = mmap( NULL, length, PROT_READ, MAP_PRIVATE, fd, 0 );
+    close( fd );
+    if( map == MAP_FAILED ) {
+        fprintf( stderr, "ERROR: cannot map program %s\n", file );
+        exit(EXIT_FAILURE);
+    }
+    madvise( map, length, MADV_SEQUENTIAL );
+    
+    // every instruction takes a byte at least, so the counts are bounded
+    //  by the length before anything is allocated
+    mcb_reader_t in = { (const char*) map, (const char*) map + length };
+    mcb_header_t header;
+    bool ok = mcb_read( &in, &header, sizeof(header) ) &&
+              memcmp( header.magic, MCB_MAGIC, sizeof(header.magic) ) == 0 &&
+              header.version == MCB_VERSION &&
+              header.size <= length && header.signals_size <= length;
+    
+    program_t* program = init_program();
+    if( ok ) {
+        reserve_code( program, header.size );
+        reserve_signals( program, header.signals_size );
+    }
+    for( uint64_t pc=0 ; ok && pc<header.size ; ++pc ) {
+        instruction_t ins = { 0, 0, 0, 0.0, { false, 0, 0 }, { false, 0, 0 } };
+        uint8_t opname = 0;
+        ok = mcb_read( &in, &opname, sizeof(opname) ) &&
+             mcb_read_qid( &in, &ins.qid1 );
+        ins.opname = opname;
+        switch( ins.opname ) {
+            case 'E':
+                ok = ok && mcb_read_qid( &in, &ins.qid2 );
+                break;
+            case 'M':
+                ok = ok && mcb_read( &in, &ins.angle, sizeof(ins.angle) ) &&
+                     mcb_read_signal( &in, program, &ins.s ) &&
+                     mcb_read_signal( &in, program, &ins.t );
+                break;
+            case 'X':
+            case 'Z':
+                ok = ok && mcb_read_signal( &in, program, &ins.s );
+                break;
+            default:
+                ok = false;
+                break;
+        }
+        program->code[program->size++] = ins;
+    }
+    ok = ok && in.at == in.end && program->signals_size == header.signals_size;
+    munmap( map, length );
+    if( !ok ) {
+        free_program( program );
+        fprintf( stderr, "ERROR: %s is not a compiled program "
+                "(or is damaged)\n", file );
+        exit(EXIT_FAILURE);
+    }
+    return program;
+}
+
+// reads, schedules and compiles a program (from a file, or stdin),
+//  or loads it when it is already compiled
+program_t* read_program( const char* program_file, int silent ) {
+    if( program_file && is_mcb( program_file ) ) {
+        program_t* program = load_program( program_file );
+        if( !silent )
+            printf("I have loaded %ld instructions from %s\n",
+                   program->size, program_file);
+        return program;
+    }
+    
+    int program_fd =
+    program_file ?                  // did the user pass a non-option argument?
+    open(program_file, O_RDONLY) :  // open the file
+    0;                              // otherwise, use stdin
+    sexp_iowrap_t* input_port = init_iowrap( program_fd );
+    sexp_t* mc_program = read_one_sexp( input_port );
+    if( program_fd )
+        close( program_fd );
+    
+    if (!silent) {
+        CSTRING* str = snew( 0 );
+        print_sexp_cstr( &str, mc_program, STRING_SIZE );
+        printf("I have read: \n%s\n", toCharPtr(str) );
+        sdestroy( str );
+    }
+    // emit dot file
+    /* sexp_to_dotfile( mc_program->list, "mc_program.dot" ); */
+    
+    if( _schedule_ )
+        mc_program->list = schedule( mc_program->list );
+    
+    program_t* program = compile( mc_program->list );
+    destroy_iowrap( input_port );
+    destroy_sexp( mc_program );
+    return program;
+}
+
+/***************
+ ** STREAMING **
+ ***************/
+// a program can also be run while it is being read: a reader thread splits
+//  the input in commands, compiles them in chunks of STREAM_CHUNK
+//  instructions and hands the chunks to the evaluator through a queue of at
+//  most STREAM_DEPTH chunks. Parsing overlaps execution, and memory does not
+//  grow with the length of the program.
+// Streaming is asked for with --stream. Each chunk runs on its own, so the
+//  passes that look at the whole program do not run with it: -S, -c and -L
+//  (and neither do -n, -b, -r or a compiled program).
+//
+//  reader:  fd --> (command) --> compile_command --> chunk --+
+//                                                            | queue
+//  evaluator:           free_program <-- execute <-- chunk <-+
+//
+// a NULL chunk ends the program
+
+#define STREAM_BUFFER 65536
+#define STREAM_CHUNK 1024
+#define STREAM_DEPTH 16
+
+typedef tbb::concurrent_bounded_queue<program_t*> chunk_queue_t;
+
+// compiles the text of one command (or a whole program of one command) into
+//  the chunk, false if it is unknown
+bool compile_text( std::string& text, program_t* chunk ) {
+    sexp_t* command = parse_sexp( &text[0], text.size() );
+    bool known = command && car(command) && compile_command( car(command), chunk );
+    destroy_sexp( command );
+    text.clear();
+    return known;
+}
+
+// splits the input at the commands of the top level list, so only one command
+//  is parsed at a time; a program of a single command is parsed whole
+void read_commands( int fd, chunk_queue_t* queue ) {
+    char* buffer = (char*) malloc(STREAM_BUFFER); //ALLOC buffer
+    std::string text;       // the command being read
+    int depth = 0;          // of the parentheses
+    bool single = false;    // the program is a single command
+    bool comment = false;   // up to the end of the line
+    bool done = false;
+    program_t* chunk = init_program();
+    
+    while( !done ) {
+        ssize_t count = read( fd, buffer, STREAM_BUFFER );
+        if( count <= 0 )
+            break;
+        for( ssize_t k=0 ; k < count && !done ; ++k ) {
+            char c = buffer[k];
+            if( comment || c == ';' ) {
+                comment = c != '\n';
+                continue;
+            }
+            if( c == '(' )
+                ++depth;
+            else if( depth == 1 && !single && !isspace(c) && c != ')' ) {
+                single = true;      // an atom at the top level
+                text = "(";
+            }
+            if( depth >= 2 || single )
+                text += c;
+            if( c == ')' && --depth <= 1 ) {
+                if( depth == 1 && !single )
+                    done = !compile_text( text, chunk );
+                else if( depth == 0 ) {
+                    if( single )
+                        compile_text( text, chunk );
+                    done = true;
+                }
+                if( chunk->size == STREAM_CHUNK ) {
+                    queue->push( chunk );
+                    chunk = init_program();
+                }
+            }
+        }
+    }
+    queue->push( chunk );
+    queue->push( NULL );
+    free( buffer ); //FREE buffer
+}
+
+// runs a program (from a file, or stdin) while it is being read
+template <class real>
+void stream_program( const char* program_file, qmem_t<real>* qmem ) {
+    int program_fd =
+    program_file ?                  // did the user pass a non-option argument?
+    open(program_file, O_RDONLY) :  // open the file
+    0;                              // otherwise, use stdin
+    if( program_fd < 0 ) {
+        fprintf( stderr, "ERROR: cannot open program %s\n", program_file );
+        exit(EXIT_FAILURE);
+    }
+    
+    chunk_queue_t queue;
+    queue.set_capacity( STREAM_DEPTH );
+    std::thread reader( read_commands, program_fd, &queue );
+    
+    program_t* chunk;
+    queue.pop( chunk );
+    while( chunk ) {
+        execute( chunk, qmem );
+        free_program( chunk );
+        queue.pop( chunk );
+    }
+    
+    reader.join();
+    if( program_fd )
+        close( program_fd );
+}
+
+template <class real>
+std::complex<real> parse_complex( const char* str ) {
     char* next_str = NULL;
     char* last_str = NULL;
-    quantum::real real = strtod(str, &next_str);
-    quantum::real imaginary = strtod(next_str, &last_str);
+    real real_part = strtod(str, &next_str);
+    real imaginary = strtod(next_str, &last_str);
     if( last_str && (last_str[0] == 'i') )
-        return quantum::complex(real, imaginary);
+        return std::complex<real>(real_part, imaginary);
     else
-        return quantum::complex(real, 0);
+        return std::complex<real>(real_part, 0);
 }
 
 
-void parse_tangle( const sexp_t* exp, qmem_t* qmem ) {
-    qubit_t qubit;
-    tangle_t* tangle = NULL;
+template <class real>
+void parse_tangle( const sexp_t* exp, qmem_t<real>* qmem ) {
+    qubit_t<real> qubit;
+    tangle_t<real>* tangle = NULL;
     const sexp_t* qids_exp = exp->list;
     const sexp_t* amps_exp = exp->list->next;
     
@@ -1003,27 +2656,28 @@ void parse_tangle( const sexp_t* exp, qmem_t* qmem ) {
     
     tangle = get_free_tangle(qmem);
     
-    qmem->size += 1;
-    tangle->size = sexp_list_length(qids_exp);
+    reserve_qids( tangle, sexp_list_length(qids_exp) );
+    for( ; qids; qids=qids->next )
+        append_qid( get_qid(qids), tangle );
     tangle->qureg.reserve( 1 << tangle->size );
-    tangle->qids = add_qid( get_qid(qids), tangle->qids );
-    while(qids->next) {
-        qids=qids->next;
-        append_qids( add_qid(get_qid(qids), NULL), tangle->qids );
-    }
+    index_qids( tangle, 0, qmem );
     
-    quantum::quregister& reg = tangle->qureg;
+    // the amplitudes are listed by basis state, the ones left out are 0; the
+    //  buffer may come back from the pool with an earlier register in it
+    quantum::basic_quregister<real>& reg = tangle->qureg;
+    std::fill( reg.begin(), reg.end(), std::complex<real>(0) );
     sexp_t* amp = amps_exp->list;
     for( int i=0; i<num_amps ;  ++i ) {
-        reg[atoi(amp->list->val)] = parse_complex(amp->list->next->val);
+        reg[atoi(amp->list->val)] = parse_complex<real>(amp->list->next->val);
         amp=amp->next;
     }
 }
 
-const tangle_t* fetch_first_tangle( const qmem_t* qmem ) {
+template <class real>
+const tangle_t<real>* fetch_first_tangle( const qmem_t<real>* qmem ) {
     
     for(int i=0; i<MAX_TANGLES; ++i) {
-        const tangle_t* tangle = qmem->tangles[i];
+        const tangle_t<real>* tangle = qmem->tangles[i];
         if( tangle )
             return tangle;
     }
@@ -1033,24 +2687,23 @@ const tangle_t* fetch_first_tangle( const qmem_t* qmem ) {
 
 /* prints ONLY THE FIRST TANGLE in sexpr form to file, same format as input file, but
  also produces 0's */
+template <class real>
 void
 produce_output_file( const char* output_file,
-                    const qmem_t* qmem ) {
+                    const qmem_t<real>* qmem ) {
     CSTRING* out = snew(STRING_SIZE);
     char str[STRING_SIZE];
     //  int count=0;
-    const tangle_t* tangle = fetch_first_tangle(qmem);
+    const tangle_t<real>* tangle = fetch_first_tangle(qmem);
     assert( tangle );
     assert( output_file );
     saddch(out,'(');
     // print qids
     saddch(out, '(');
-    for( const qid_list_t* cons = tangle->qids;
-        cons;
-        cons=cons->rest ) {
-        sprintf(str,"%ld", cons->qid);
+    for( pos_t pos=0 ; pos < tangle->size ; ++pos ) {
+        sprintf(str,"%ld", tangle->qids[pos]);
         sadd(out, str);
-        if( cons->rest )
+        if( pos+1 < tangle->size )
             saddch(out, ' ');
     }
     // end qids
@@ -1058,7 +2711,7 @@ produce_output_file( const char* output_file,
     
     // print (basis amplitude)
     saddch(out, '(');
-    const quantum::quregister& reg = tangle->qureg;
+    const quantum::basic_quregister<real>& reg = tangle->qureg;
     for(quantum::size_type i=0; i<reg.size(); ++i ) {
         sprintf(str,"(%li ", i);
         sadd(out, str);
@@ -1079,7 +2732,8 @@ produce_output_file( const char* output_file,
     sdestroy(out);
 }
 
-void initialize_input_state( const char* input_file, qmem_t* qmem ) {
+template <class real>
+void initialize_input_state( const char* input_file, qmem_t<real>* qmem ) {
     if( input_file == NULL )
         return;
     int fd = open( input_file, O_RDONLY );
@@ -1091,25 +2745,415 @@ void initialize_input_state( const char* input_file, qmem_t* qmem ) {
     close(fd);  
 }
 
-int main(int argc, char* argv[]) {
-    sexp_iowrap_t* input_port;
-    sexp_t* mc_program;
-    qmem_t* qmem = init_qmem();
-    CSTRING* str = snew( 0 );
+// applies what is still pending, then normalizes: at the end, not during
+//  measurement
+template <class real>
+void finish_qmem( qmem_t<real>* qmem ) {
+    flush_qmem( qmem );
+    
+    int tally=0;
+    tangle_t<real>* tangle=NULL;
+    for( int t=0; tally<qmem->size; ++t ) {
+        tangle = qmem->tangles[t];
+        if( tangle ) {
+            quantum::backend<real>::normalize( tangle->qureg, tangle->qureg );
+            ++tally;
+        }
+    }
+}
+
+/***********
+ ** BATCH **
+ ***********/
+// runs one program over many input states (-b): the files of a directory, or
+//  the records of a single file, each one tangle as for -f. The program is
+//  compiled once, the output of each input goes to <output>-<name>, with the
+//  file name or the record number (from 0) as name.
+// The width of the program is measured on each input (see build_task_graph):
+//  inputs on which it stays narrower than BATCH_WIDTH qubits run
+//  concurrently, one per task; wider ones one at a time after them, on the
+//  parallel operators.
+
+#define BATCH_WIDTH 16
+
+typedef struct batch_input {
+    std::string name;
+    sexp_t* state;
+} batch_input_t;
+
+sexp_t* read_state( const char* file ) {
+    int fd = open( file, O_RDONLY );
+    if( fd < 0 ) {
+        fprintf( stderr, "ERROR: cannot open input state %s\n", file );
+        exit(EXIT_FAILURE);
+    }
+    sexp_iowrap_t* input_port = init_iowrap( fd );
+    sexp_t* state = read_one_sexp( input_port );
+    destroy_iowrap( input_port );
+    close( fd );
+    return state;
+}
+
+std::vector<batch_input_t> read_batch( const char* path ) {
+    std::vector<batch_input_t> inputs;
+    struct stat st;
+    if( stat( path, &st ) != 0 ) {
+        fprintf( stderr, "ERROR: cannot open batch %s\n", path );
+        exit(EXIT_FAILURE);
+    }
+    
+    if( S_ISDIR(st.st_mode) ) {
+        DIR* dir = opendir( path );
+        std::vector<std::string> names;
+        for( struct dirent* entry = readdir(dir); entry; entry = readdir(dir) ) {
+            std::string file = std::string(path) + "/" + entry->d_name;
+            if( entry->d_name[0] != '.' &&
+               stat( file.c_str(), &st ) == 0 && S_ISREG(st.st_mode) )
+                names.push_back( entry->d_name );
+        }
+        closedir( dir );
+        std::sort( names.begin(), names.end() );
+        for( size_t k=0 ; k < names.size() ; ++k ) {
+            std::string file = std::string(path) + "/" + names[k];
+            batch_input_t input = { names[k], read_state( file.c_str() ) };
+            inputs.push_back( input );
+        }
+    }
+    else {
+        int fd = open( path, O_RDONLY );
+        sexp_iowrap_t* input_port = init_iowrap( fd );
+        for( sexp_t* state = read_one_sexp( input_port );
+            state ; state = read_one_sexp( input_port ) ) {
+            batch_input_t input = { std::to_string( inputs.size() ), state };
+            inputs.push_back( input );
+        }
+        destroy_iowrap( input_port );
+        close( fd );
+    }
+    
+    for( size_t k=0 ; k < inputs.size() ; ++k )
+        if( !inputs[k].state ) {
+            fprintf( stderr, "ERROR: input state %s is empty\n",
+                    inputs[k].name.c_str() );
+            exit(EXIT_FAILURE);
+        }
+    return inputs;
+}
+
+// runs the program on one input, unless it gets BATCH_WIDTH qubits wide on
+//  it and wide is false: that input is left for later. Returns the width.
+template <class real>
+qid_t run_input( const program_t* program,
+                const batch_input_t* input,
+                const char* output_file,
+                bool wide ) {
+    qmem_t<real>* qmem = init_qmem<real>();
+    parse_tangle( input->state, qmem );
+    task_graph_t graph;
+    build_task_graph( program, qmem, &graph );
+    if( wide || graph.width < BATCH_WIDTH ) {
+        execute( program, qmem );
+        finish_qmem( qmem );
+        std::string output = std::string(output_file) + "-" + input->name;
+        produce_output_file( output.c_str(), qmem );
+    }
+    free_qmem( qmem );
+    return graph.width;
+}
+
+template <class real>
+int run_batch( const char* batch,
+              const char* output_file,
+              const char* program_file,
+              int silent ) {
+    std::vector<batch_input_t> inputs = read_batch( batch );
+    program_t* program = read_program( program_file, 1 );
+    if( !output_file )
+        output_file = "out";
+    
+    std::vector<qid_t> widths( inputs.size() );
+    tbb::task_group tasks;
+    for( size_t k=0 ; k < inputs.size() ; ++k )
+        tasks.run( [&, k]{ widths[k] = run_input<real>( program, &inputs[k], output_file, false ); } );
+    tasks.wait();
+    
+    qid_t width = 0;
+    size_t wide = 0;
+    for( size_t k=0 ; k < inputs.size() ; ++k ) {
+        if( widths[k] >= BATCH_WIDTH ) {
+            run_input<real>( program, &inputs[k], output_file, true );
+            ++wide;
+        }
+        if( widths[k] > width )
+            width = widths[k];
+    }
+    release_buffers<real>();
+    
+    if( !silent )
+        printf("I have run %lu inputs (up to %ld qubits wide, %lu of them "
+               "one at a time) to %s-*\n",
+               inputs.size(), width, wide, output_file);
+    if( _verbose_ )
+        pages::report( stdout );
+    
+    for( size_t k=0 ; k < inputs.size() ; ++k )
+        destroy_sexp( inputs[k].state );
+    free_program( program );
+    sexp_cleanup();
+    return 0;
+}
+
+/***********
+ ** SHOTS **
+ ***********/
+// runs a program for many shots at once (-n): the shots share their state
+//  until a measurement sends them to different outcomes, where the state
+//  forks and each branch goes on with its own shots. A fork shares the
+//  tangles of its parent until one of them writes to a tangle (see
+//  own_tangle), and the measured register is not copied at all: both
+//  outcomes come out of the same pass (see branch). The program thus runs
+//  once per distinct branch, from the fork on, instead of once per shot.
+// Shot k draws its outcomes as -R does, with draw( qid, k ): shot 0 takes the
+//  outcomes of a run with -R and the same seed.
+// The branches run one at a time, depth first, so that only the pending
+//  forks are kept.
+
+// a branch: the shots that drew the same outcomes so far (in increasing
+//  order), and their state before instruction pc
+template <class real>
+struct shot_branch_t {
+    qmem_t<real>* qmem;
+    qid_t pc;
+    std::vector<uint64_t> shots;
+};
+
+// measures a qubit for the shots of a branch, and counts their outcomes in
+//  histogram[2 qid + outcome]; the shots drawing outcome 1 move to 'forked',
+//  and when both outcomes are drawn, their fork of qmem is returned
+template <class real>
+qmem_t<real>* fork_M( const qid_t qid,
+                     double angle,
+                     std::vector<uint64_t>& shots,
+                     std::vector<uint64_t>& forked,
+                     qmem_t<real>* qmem,
+                     std::vector<unsigned long>& histogram ) {
+    qubit_t<real> qubit = prepare_M( qid, &angle, qmem );
+    quantum::basic_quregister<real> minus;
+    real norm_plus, norm_minus;
+    
+    if (_in_place_) {
+        quantum::basic_quregister<real>& qureg = get_qureg(qubit);
+        quantum::backend<real>::branch( get_target(qubit), angle,
+                                       norm_plus, norm_minus,
+                                       qureg, qureg, minus );
+    }
+    else {
+        quantum::basic_quregister<real> old_qureg = get_qureg(qubit);
+        qubit.tangle->qureg.reset();
+        quantum::backend<real>::branch( get_target(qubit), angle,
+                                       norm_plus, norm_minus,
+                                       old_qureg, qubit.tangle->qureg, minus );
+    }
     
+    // outcome 1 as quantum::choose draws it
+    const real total = norm_plus + norm_minus;
+    const real p = total > 0 ? norm_minus / total : 1;
+    std::vector<uint64_t> stay;
+    forked.clear();
+    for( size_t k=0 ; k < shots.size() ; ++k ) {
+        if( (real)draw( qid, shots[k] ) < p )
+            forked.push_back( shots[k] );
+        else
+            stay.push_back( shots[k] );
+    }
+    histogram[2 * qid] += stay.size();
+    histogram[2 * qid + 1] += forked.size();
+    
+    if( stay.empty() ) {
+        // all shots go to outcome 1, on this qmem
+        get_qureg(qubit).swap( minus );
+        record_M( qubit, 1, p, qmem );
+        forked.clear();
+        return NULL;
+    }
+    shots.swap( stay );
+    
+    qmem_t<real>* fork = NULL;
+    if( !forked.empty() ) {
+        fork = fork_qmem( qmem );
+        tangle_t<real>* tangle = copy_tangle( qubit.tangle );
+        tangle->qureg.swap( minus );
+        replace_tangle( qubit.tangle, tangle, fork );
+        record_M( find_qubit( qid, fork ), 1, p, fork );
+    }
+    record_M( qubit, 0, 1 - p, qmem );
+    return fork;
+}
+
+// runs the shots from qmem, returns the final qmem of shot 0 (the others
+//  are freed) and the number of branches
+template <class real>
+qmem_t<real>* run_shots( const program_t* program,
+                        qmem_t<real>* qmem,
+                        std::vector<unsigned long>& histogram,
+                        size_t* branches ) {
+    std::vector< shot_branch_t<real> > pending( 1 );
+    pending[0].qmem = qmem;
+    pending[0].pc = 0;
+    for( uint64_t k=0 ; k < _shots_ ; ++k )
+        pending[0].shots.push_back( k );
+    
+    qmem_t<real>* result = NULL;
+    *branches = 0;
+    while( !pending.empty() ) {
+        shot_branch_t<real> branch;
+        branch.qmem = pending.back().qmem;
+        branch.pc = pending.back().pc;
+        branch.shots.swap( pending.back().shots );
+        pending.pop_back();
+        
+        for( qid_t pc=branch.pc ; pc < program->size ; ++pc ) {
+            const instruction_t* ins = &program->code[pc];
+            if( ins->opname != 'M' ) {
+                exec_instruction( program, ins, branch.qmem );
+                continue;
+            }
+            if( _layout_ )
+                layout_tangle( program, pc, branch.qmem );
+            shot_branch_t<real> fork;
+            fork.qmem = fork_M( ins->qid1,
+                               instruction_angle(program, ins, branch.qmem),
+                               branch.shots, fork.shots,
+                               branch.qmem, histogram );
+            if( fork.qmem ) {
+                fork.pc = pc + 1;
+                pending.push_back( shot_branch_t<real>() );
+                pending.back().qmem = fork.qmem;
+                pending.back().pc = fork.pc;
+                pending.back().shots.swap( fork.shots );
+            }
+        }
+        
+        *branches += 1;
+        // the registers of a finished branch stay in the pool, for the next
+        //  branch and the minus buffers of fork_M
+        if( branch.shots.front() == 0 )
+            result = branch.qmem;
+        else
+            free_qmem( branch.qmem );
+    }
+    release_buffers<real>();
+    return result;
+}
+
+// prints, for each measured qid, how many shots drew 0 and 1
+void print_histogram( const std::vector<unsigned long>& histogram,
+                     const size_t branches ) {
+    printf("%lu shots in %lu branches, outcomes per qid (0s 1s):\n",
+           (unsigned long)_shots_, (unsigned long)branches);
+    for( qid_t qid=0 ; qid < MAX_QUBITS ; ++qid )
+        if( histogram[2 * qid] + histogram[2 * qid + 1] )
+            printf("  %ld: %lu %lu\n", qid,
+                   histogram[2 * qid], histogram[2 * qid + 1]);
+}
+
+// runs a program (from a file, or interactively) on a fresh qmem, with
+//  registers of the given real type
+template <class real>
+int run( const char* input_file,
+        const char* output_file,
+        const char* program_file,
+        int interactive,
+        int silent ) {
+    qmem_t<real>* qmem = init_qmem<real>();
+    
+    initialize_input_state(input_file, qmem);
+    
+    if (_verbose_) {
+        printf("Initial QMEM:\n ");
+        print_qmem( qmem );
+    }
+    if( interactive ) {
+        printf("Starting PQVM in interactive mode.\npqvm> ");
+        sexp_iowrap_t* input_port = init_iowrap( 0 );  // we are going to read from stdin
+        sexp_t* mc_program = read_one_sexp( input_port );
+        while( mc_program ) {
+            eval( mc_program->list, qmem );
+            flush_qmem( qmem );
+            print_qmem( qmem );
+            printf("\npqvm> ");
+            destroy_sexp( mc_program );
+            mc_program = read_one_sexp( input_port );
+        }
+        destroy_iowrap( input_port );
+    }
+    else if( _shots_ ) {
+        program_t* program = read_program( program_file, silent );
+        std::vector<unsigned long> histogram( 2 * MAX_QUBITS );
+        size_t branches;
+        qmem = run_shots( program, qmem, histogram, &branches );
+        print_histogram( histogram, branches );
+        free_program( program );
+    }
+    else if( _stream_ ) {
+        stream_program( program_file, qmem );
+    }
+    else {
+        program_t* program = read_program( program_file, silent );
+        execute( program, qmem );
+        free_program( program );
+    }
+    
+    finish_qmem( qmem );
+    
+    if (!silent && _random_ && !_shots_)
+        printf("Sampled outcomes: %lu times 0, %lu times 1\n",
+               _outcomes_[0].load(), _outcomes_[1].load());
+    
+    if (!silent) {
+        printf("Resulting quantum memory is:\n");
+        print_qmem( qmem );
+    }
+    
+    if( output_file ) {
+        produce_output_file(output_file, qmem);
+    }
+    
+    if( _verbose_ )
+        pages::report( stdout );
+    
+    sexp_cleanup();
+    free_qmem( qmem );
+    release_buffers<real>();
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
     int interactive = 0;
     int silent = 0;
+    int single = 0;
+    int compile_only = 0;
+    char* input_file = NULL;
     char* output_file = NULL;
-    int program_fd;
+    char* program_file = NULL;
+    char* batch = NULL;
     int c;
     
     opterr = 0;
     
+    static struct option long_options[] = {
+        { "compile", no_argument, NULL, 'C' },
+        { "stream", no_argument, NULL, 'T' },
+        { NULL, 0, NULL, 0 }
+    };
+    
     //override later
     quantum::implementation("tbb_blk");
+    _in_place_ = 1;
     
 
-    while ((c = getopt (argc, argv, "rsvmp:f:i:o::g:")) != -1)
+    while ((c = getopt_long (argc, argv, "rsvmlLSHcp:f:b:i:o::g:P:R:n:N:",
+                             long_options, NULL)) != -1)
 
 
         switch (c)
@@ -1125,6 +3169,42 @@ int main(int argc, char* argv[]) {
             break;
         case 'm':
             break;
+        case 'l': // lazy entanglement
+            _lazy_ = 1;
+            break;
+        case 'L': // lay the tangles out for their next measurements
+            _layout_ = 1;
+            break;
+        case 'S': // schedule the program
+            _schedule_ = 1;
+            break;
+        case 'c': // run instructions on different tangles concurrently
+            _concurrent_ = 1;
+            break;
+        case 'C': // --compile: save the compiled program, do not run it
+            compile_only = 1;
+            break;
+        case 'T': // --stream: run the program while it is read
+            _stream_ = 1;
+            break;
+        case 'R': // sample the measurement outcomes, with this seed
+            _random_ = 1;
+            _seed_ = strtoull(optarg, NULL, 0);
+            break;
+        case 'n': // run this many shots at once, sampling their outcomes
+            _random_ = 1;
+            _shots_ = strtoull(optarg, NULL, 0);
+            break;
+        case 'H': // map large registers on huge pages
+            pages::huge() = true;
+            break;
+        case 'N': // NUMA placement of the registers
+            if (!numa::select(optarg)) {
+                fprintf (stderr, "Unknown placement `%s', "
+                         "use none, interleave or touch.\n", optarg);
+                return 1;
+            }
+            break;
         case 'p':
             if (strcmp(optarg, "") == 0)
                 thread_control::set_threads(0);
@@ -1132,11 +3212,15 @@ int main(int argc, char* argv[]) {
                 thread_control::set_threads(atoi(optarg));
             break;
         case 'f':
-            initialize_input_state(optarg, qmem);
+            input_file = optarg;
+            break;
+        case 'b': // batch of input states
+            batch = optarg;
             break;
         case 'i':
             quantum::implementation(std::string(optarg));
-            if (std::string(optarg) == "tbb_blk") _in_place_ = 1;
+            _in_place_ = (std::string(optarg) == "tbb_blk" ||
+                          std::string(optarg) == "simd");
             break;
         case 'o':
             output_file = optarg;
@@ -1144,8 +3228,19 @@ int main(int argc, char* argv[]) {
         case 'g':
             quantum::set_grainsize(atoi(optarg));
             break;
+        case 'P': // precision of the amplitudes
+            if (strcmp(optarg, "float") == 0)
+                single = 1;
+            else if (strcmp(optarg, "double") == 0)
+                single = 0;
+            else {
+                fprintf (stderr, "Unknown precision `%s', "
+                         "use float or double.\n", optarg);
+                return 1;
+            }
+            break;
         case '?':
-            if (optopt == 'f')
+            if (optopt == 'f' || optopt == 'b' || optopt == 'P' || optopt == 'R' || optopt == 'n' || optopt == 'N')
                 fprintf (stderr, "Option -%c requires an argument.\n", optopt);
             else if (optopt == 'o') {
                 output_file = "out";
@@ -1162,71 +3257,68 @@ int main(int argc, char* argv[]) {
             abort ();
     }
     
-    //
+    if( optind < argc )
+        program_file = argv[optind];
     
-    if (_verbose_) {
-        printf("Initial QMEM:\n ");
-        print_qmem( qmem );
-    }
-    if( interactive ) {
-        printf("Starting PQVM in interactive mode.\npqvm> ");
-        input_port = init_iowrap( 0 );  // we are going to read from stdin
-        mc_program = read_one_sexp( input_port );
-        while( mc_program ) {
-            eval( mc_program->list, qmem );
-            print_qmem( qmem );
-            printf("\npqvm> ");
-            destroy_sexp( mc_program );
-            mc_program = read_one_sexp( input_port );
+    if( _verbose_ )
+        printf("NUMA placement: %s, %d node(s)%s\n", numa::name(), numa::nodes(),
+               numa::available() ? "" : ", no NUMA support");
+    
+    if( compile_only ) {
+        std::string mcb_file;
+        if( output_file )
+            mcb_file = output_file;
+        else if( optind + 1 < argc )    // -o out.mcb, -o takes no separate argument
+            mcb_file = argv[optind + 1];
+        else if( program_file ) {       // in.mc -> in.mcb
+            mcb_file = program_file;
+            size_t dot = mcb_file.rfind('.');
+            if( dot != std::string::npos && mcb_file.find('/', dot) == std::string::npos )
+                mcb_file.erase(dot);
+            mcb_file += ".mcb";
         }
-    }
-    else {
-        // read input program
-        program_fd = 
-        optind < argc ?                // did the user pass a non-option argument?
-        open(argv[optind], O_RDONLY) : // open the file
-        0;                             // otherwise, use stdin
-        input_port = init_iowrap( program_fd );
-        mc_program = read_one_sexp( input_port );
-        if( program_fd )
-            close( program_fd );
-        
-        if (!silent) {
-            print_sexp_cstr( &str, mc_program, STRING_SIZE );
-            printf("I have read: \n%s\n", toCharPtr(str) );
+        else {
+            fprintf (stderr, "--compile needs an output file (-o out.mcb).\n");
+            return 1;
         }
-        // emit dot file
-        /* sexp_to_dotfile( mc_program->list, "mc_program.dot" ); */
-        
-        eval( mc_program->list, qmem );
+        program_t* program = read_program( program_file, 1 );
+        save_program( program, mcb_file.c_str() );
+        if( !silent )
+            printf("Compiled %ld instructions to %s\n",
+                   program->size, mcb_file.c_str());
+        free_program( program );
+        sexp_cleanup();
+        return 0;
     }
     
-    //normalize at the end, not during measurement
-    
-    int tally=0;
-    tangle_t* tangle=NULL;
-    for( int t=0; tally<qmem->size; ++t ) {
-        tangle = qmem->tangles[t];
-        if( tangle ) {
-            quantum::normalize( tangle->qureg, tangle->qureg );
-            ++tally;
-        }
+    if( _layout_ && _concurrent_ ) {
+        fprintf (stderr, "Option -L does not run with -c.\n");
+        return 1;
     }
     
-    if (!silent) {
-        printf("Resulting quantum memory is:\n");
-        print_qmem( qmem );
+    if( _stream_ && ( _schedule_ || _concurrent_ || _layout_ || _shots_ ||
+                     batch || interactive ||
+                     (program_file && is_mcb( program_file )) ) ) {
+        fprintf (stderr, "Option --stream does not run with -S, -c, -L, -n, "
+                 "-b, -r or a compiled program.\n");
+        return 1;
     }
-    
-    if( output_file ) {
-        produce_output_file(output_file, qmem);
+
+    if( batch ) {
+        if( _shots_ ) {
+            fprintf (stderr, "Option -n does not run with -b.\n");
+            return 1;
+        }
+        if( single )
+            return run_batch<float>(batch, output_file, program_file, silent);
+        else
+            return run_batch<double>(batch, output_file, program_file, silent);
     }
     
-    destroy_iowrap( input_port );
-    sdestroy( str );
-    destroy_sexp( mc_program );
-    sexp_cleanup();
-    free_qmem( qmem );
-    return 0;
-    
+    if( single )
+        return run<float>(input_file, output_file, program_file,
+                          interactive, silent);
+    else
+        return run<double>(input_file, output_file, program_file,
+                           interactive, silent);
 }
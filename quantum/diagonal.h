@@ -0,0 +1,113 @@
+#ifndef pqvm_quantum_diagonal_h
+#define pqvm_quantum_diagonal_h
+
+#include <algorithm>
+#include <vector>
+#include "types.h"
+
+/*
+ * Fused diagonal operators.
+ * A run of Z and CZ operators is given as a list of masks, one per operator:
+ *
+ *     Z on t        m = 2^t
+ *     CZ on c, t    m = 2^c + 2^t
+ *
+ * The operators commute, and amplitude i changes sign once for every mask
+ * m with (i & m) == m, so the whole run is applied in a single pass.
+ *
+ * The sign is a quadratic form in the bits of i. Split an index in a high
+ * part h and a low part l (the lowest bits, at most 2^low_bits amplitudes),
+ * then
+ *
+ *     sign(h + l) = f(h) ^ g(l) ^ parity(l & c(h))
+ *
+ *     f(h)  the masks with all bits in the high part, on h
+ *     g(l)  the masks with all bits in the low part, on l
+ *     c(h)  the xor of the low bits of the masks with one bit in each part,
+ *           for those whose high bit is set in h
+ *
+ * g is tabulated once, f and c are computed once per block of amplitudes
+ * with the same high part: the cost per amplitude does not depend on the
+ * number of operators.
+ */
+
+namespace quantum {
+
+    class sign_form {
+    public:
+        static const size_type low_bits = 10;
+
+    private:
+        size_type _low;                   //mask of the low part of an index
+        size_type _z;                     //Z masks in the high part
+        std::vector<size_type> _high;     //CZ masks in the high part
+        std::vector<size_type> _cross;    //CZ masks across both parts
+        unsigned char _table[1 << low_bits];
+
+        static inline bool parity (size_type x) {
+            return __builtin_parityl(x);
+        }
+
+        static inline bool single (size_type m) {
+            return (m & (m - 1)) == 0;
+        }
+
+    public:
+        /*
+         * Sort the masks of the operators on a register of n amplitudes.
+         */
+        sign_form (const size_type* masks, const size_type count, const size_type n) :
+        _low (std::min(n, (size_type)1 << low_bits) - 1), _z (0) {
+            size_type z = 0;
+            std::vector<size_type> low;
+
+            for (size_type k = 0; k < count; ++k) {
+                size_type m = masks[k];
+                if (single(m)) {
+                    if (m & _low) z ^= m;
+                    else _z ^= m;
+                }
+                else if ((m & _low) == m) low.push_back(m);
+                else if ((m & _low) == 0) _high.push_back(m);
+                else _cross.push_back(m);
+            }
+
+            for (size_type l = 0; l <= _low; ++l) {
+                bool s = parity(l & z);
+                for (size_type k = 0; k < low.size(); ++k)
+                    s ^= (l & low[k]) == low[k];
+                _table[l] = s;
+            }
+        }
+
+        inline size_type low () const {
+            return _low;
+        }
+
+        /*
+         * f(h), and c(h) in cross, for the block of index i.
+         */
+        inline bool high (const size_type i, size_type& cross) const {
+            size_type h = i & ~_low;
+            bool s = parity(h & _z);
+            for (size_type k = 0; k < _high.size(); ++k)
+                s ^= (h & _high[k]) == _high[k];
+            cross = 0;
+            for (size_type k = 0; k < _cross.size(); ++k)
+                if (h & _cross[k])
+                    cross ^= _cross[k] & _low;
+            return s;
+        }
+
+        /*
+         * The sign of amplitude i, given f and c of its block.
+         */
+        inline bool sign (const size_type i, const bool f, const size_type cross) const {
+            size_type l = i & _low;
+            return f ^ _table[l] ^ parity(l & cross);
+        }
+    };
+
+}
+
+#endif
@@ -0,0 +1,151 @@
+#ifndef pqvm_quantum_gates_h
+#define pqvm_quantum_gates_h
+
+#include <algorithm>
+#include <complex>
+#include <vector>
+#include "types.h"
+
+/*
+ * Gate lists.
+ * A short list of X, Z, CZ and phase kick gates is applied to a register
+ * tile by tile: a tile holds 2^tile_bits amplitudes (512KiB of doubles, the
+ * size of an L2 cache), and every gate of a run is applied to one tile
+ * before the next one is loaded. A run of k gates sweeps the register once,
+ * instead of k times.
+ *
+ * The diagonal gates never move an amplitude, and X on a target below
+ * tile_bits only moves it within its tile, so these all join a run. X on a
+ * high target swaps whole tiles; it ends the run and takes a pass of its
+ * own, over pairs of tiles:
+ *
+ *     list  Z 3, X 1, X 20, CZ 2 4, X 0
+ *     runs  (Z 3, X 1) (X 20) (CZ 2 4, X 0)
+ *
+ * The gates are applied in the order of the list.
+ */
+
+namespace quantum {
+
+    struct gate {
+        enum kind { x, z, cz, kick };
+
+        kind op;
+        size_type a, b;                   //target, and the other target of cz
+        double angle;                     //angle of the phase kick
+    };
+
+    class gate_runs {
+    public:
+        static const size_type tile_bits = 15;
+
+    private:
+        const gate* _list;
+        size_type _tile;                  //amplitudes per tile
+        std::vector<size_type> _ends;     //end of each run, in the list
+
+        template <class C>
+        static inline void multiply (C* amp, const size_type n, const size_type mask, const C factor) {
+            for (size_type i = 0; i < n; ++i)
+                if ((i & mask) == mask) amp[i] *= factor;
+        }
+
+    public:
+        /*
+         * Split the list of count gates, on a register of n amplitudes.
+         */
+        gate_runs (const gate* list, const size_type count, const size_type n) :
+        _list (list), _tile (std::min(n, (size_type)1 << tile_bits)) {
+            for (size_type k = 0; k < count; ++k) {
+                if (list[k].op == gate::x && ((size_type)1 << list[k].a) >= _tile) {
+                    if (k > 0 && (_ends.empty() || _ends.back() < k))
+                        _ends.push_back(k);
+                    _ends.push_back(k + 1);
+                }
+            }
+            if (count > 0 && (_ends.empty() || _ends.back() < count))
+                _ends.push_back(count);
+        }
+
+        inline size_type runs () const {
+            return _ends.size();
+        }
+
+        inline size_type tile () const {
+            return _tile;
+        }
+
+        /*
+         * Is run r a single X on a high target?
+         */
+        inline bool high (const size_type r) const {
+            const gate& g = _list[r ? _ends[r - 1] : 0];
+            return g.op == gate::x && ((size_type)1 << g.a) >= _tile;
+        }
+
+        /*
+         * The number of tiles (or pairs of tiles, for a high run) of run r
+         * on a register of n amplitudes.
+         */
+        inline size_type blocks (const size_type r, const size_type n) const {
+            return high(r) ? n / _tile / 2 : n / _tile;
+        }
+
+        /*
+         * Apply run r to tile b: copy it from input to output first (unless
+         * in place), then apply the gates one after the other.
+         */
+        template <class real>
+        void apply (const size_type r, const size_type b, const std::complex<real>* input, std::complex<real>* output) const {
+            typedef std::complex<real> complex;
+            const size_type origin = b * _tile,
+                            low = _tile - 1;
+            complex* amp = output + origin;
+            if (input != output)
+                std::copy(input + origin, input + origin + _tile, amp);
+
+            for (size_type k = r ? _ends[r - 1] : 0; k < _ends[r]; ++k) {
+                const gate& g = _list[k];
+                size_type mask = ((size_type)1 << g.a);
+                switch (g.op) {
+                case gate::x:
+                    for (size_type i = 0; i < _tile; i += 2 * mask)
+                        for (size_type j = i; j < i + mask; ++j)
+                            std::swap(amp[j], amp[j + mask]);
+                    break;
+                case gate::cz:
+                    mask |= (size_type)1 << g.b;
+                    //fall through
+                case gate::z:
+                    //the high bits of the mask hold for the whole tile, or not at all
+                    if ((origin & mask & ~low) == (mask & ~low))
+                        multiply(amp, _tile, mask & low, complex(-1));
+                    break;
+                case gate::kick:
+                    if ((origin & mask & ~low) == (mask & ~low))
+                        multiply(amp, _tile, mask & low, std::conj(std::exp(complex(0, g.angle))));
+                    break;
+                }
+            }
+        }
+
+        /*
+         * Apply the high X of run r to pair p: swap the tile with the target
+         * bit clear and the one with the bit set.
+         */
+        template <class real>
+        void cross (const size_type r, const size_type p, const std::complex<real>* input, std::complex<real>* output) const {
+            typedef std::complex<real> complex;
+            const size_type bit = (size_type)1 << _list[_ends[r] - 1].a,
+                            origin = ((p * _tile) & (bit - 1)) | (((p * _tile) & ~(bit - 1)) << 1);
+            for (size_type j = origin; j < origin + _tile; ++j) {
+                complex u = input[j], v = input[j + bit];
+                output[j] = v;
+                output[j + bit] = u;
+            }
+        }
+    };
+
+}
+
+#endif
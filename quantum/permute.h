@@ -0,0 +1,110 @@
+#ifndef pqvm_quantum_permute_h
+#define pqvm_quantum_permute_h
+
+#include <vector>
+#include "types.h"
+
+/*
+ * Bit permutations.
+ * A permutation of the qubits of a register moves bit k of every index to
+ * bit map[k]: amplitude i goes to P(i). P is linear in the bits,
+ *
+ *     P(a | b) = P(a) | P(b)          for a and b without common bits
+ *
+ * so the register is moved in tiles, like a matrix transpose. The tile bits
+ * are the in_bits low bits of the input and the bits that land in the
+ * out_bits low bits of the output: a tile reads contiguous runs, and writes
+ * contiguous runs, at most 2^(in_bits + out_bits) amplitudes in all. The
+ * offsets within a tile are tabulated once, the origin of a tile is
+ * computed once per tile, from the other (outer) bits.
+ */
+
+namespace quantum {
+
+    class bit_permutation {
+    public:
+        static const size_type in_bits = 8;
+        static const size_type out_bits = 5;
+
+    private:
+        std::vector<size_type> _map;      //bit k goes to bit _map[k]
+        size_type _outer;                 //mask of the outer bits
+        size_type _blocks;                //number of tiles
+        std::vector<size_type> _in;       //offsets within a tile, in the input
+        std::vector<size_type> _out;      //the same offsets, in the output
+
+        //spread the low bits of x over the set bits of mask
+        static inline size_type deposit (size_type x, size_type mask) {
+            size_type r = 0;
+            for (size_type bit = 1; mask; bit <<= 1) {
+                size_type low = mask & -mask;
+                if (x & bit) r |= low;
+                mask ^= low;
+            }
+            return r;
+        }
+
+    public:
+        /*
+         * The permutation of a register of n = 2^bits amplitudes.
+         */
+        bit_permutation (const size_type* map, const size_type n) : _outer (n - 1) {
+            size_type bits = 0;
+            while (((size_type)1 << bits) < n) ++bits;
+            _map.assign(map, map + bits);
+
+            size_type tile = ((size_type)1 << (bits < in_bits ? bits : in_bits)) - 1,
+                      low  = ((size_type)1 << (bits < out_bits ? bits : out_bits)) - 1;
+            for (size_type k = 0; k < bits; ++k)
+                if (((size_type)1 << _map[k]) & low)
+                    tile |= (size_type)1 << k;
+            _outer &= ~tile;
+            _blocks = (size_type)1 << __builtin_popcountl(_outer);
+
+            size_type size = (size_type)1 << __builtin_popcountl(tile);
+            _in.resize(size);
+            _out.resize(size);
+            for (size_type t = 0; t < size; ++t) {
+                _in[t] = deposit(t, tile);
+                _out[t] = apply(_in[t]);
+            }
+        }
+
+        inline size_type blocks () const {
+            return _blocks;
+        }
+
+        inline size_type size () const {
+            return _in.size();
+        }
+
+        /*
+         * P(i).
+         */
+        inline size_type apply (size_type i) const {
+            size_type r = 0;
+            for (size_type k = 0; i; ++k, i >>= 1)
+                if (i & 1) r |= (size_type)1 << _map[k];
+            return r;
+        }
+
+        /*
+         * The origin of tile b, in the input and in the output.
+         */
+        inline void tile (const size_type b, size_type& in, size_type& out) const {
+            in = deposit(b, _outer);
+            out = apply(in);
+        }
+
+        inline size_type in (const size_type t) const {
+            return _in[t];
+        }
+
+        inline size_type out (const size_type t) const {
+            return _out[t];
+        }
+    };
+
+}
+
+#endif
@@ -30,6 +30,7 @@ namespace quantum {
 #include "tbb-mcp.h"
 #include "tbb-blocks.h"
 #include "tbb-range.h"
+#include "simd.h"
 
 /* 
  * Each header in the quantum folder exports these functions.
@@ -41,24 +42,113 @@ namespace quantum {
     sigma_x      = &namespace::sigma_x,       \
     sigma_z      = &namespace::sigma_z,       \
     controlled_z = &namespace::controlled_z,  \
+    diagonal     = &namespace::diagonal,      \
     kronecker    = &namespace::kronecker,     \
+    expand       = &namespace::expand,        \
     measure      = &namespace::measure,       \
+    sample       = &namespace::sample,        \
+    branch       = &namespace::branch,        \
+    permute      = &namespace::permute,       \
+    gates        = &namespace::gates,         \
     normalize    = &namespace::normalize,     \
+    scale        = &namespace::scale,         \
     phase_kick   = &namespace::phase_kick,    \
     copy         = &namespace::copy,          \
     namespace::initialize()
 
 namespace quantum {
     
-    //exported functions:
-    void (*sigma_x)      (const size_type, quregister&, quregister&);
-    void (*sigma_z)      (const size_type, quregister&, quregister&);
-    void (*controlled_z) (const size_type, const size_type, quregister&, quregister&);
-    void (*kronecker)    (quregister&, quregister&, quregister&);
-    int  (*measure)      (const size_type, const real, quregister&, quregister&);
-    void (*normalize)    (quregister&, quregister&);
-    void (*phase_kick)   (const size_type, const real, quregister&, quregister&);
-    void (*copy)         (quregister& input, quregister& output);
+    /*
+     * The exported functions, for registers of a real type.
+     * Each backend function is a template; assigning it to a pointer
+     * of the table picks the instantiation for that real type.
+     */
+    template <class real>
+    struct backend {
+        typedef basic_quregister<real> quregister;
+        
+        static void (*sigma_x)      (const size_type, quregister&, quregister&);
+        static void (*sigma_z)      (const size_type, quregister&, quregister&);
+        static void (*controlled_z) (const size_type, const size_type, quregister&, quregister&);
+        static void (*diagonal)     (const size_type*, const size_type, quregister&, quregister&);
+        static void (*kronecker)    (quregister&, quregister&, quregister&);
+        static void (*expand)       (quregister&, quregister&);
+        static int  (*measure)      (const size_type, const real, quregister&, quregister&);
+        static int  (*sample)       (const size_type, const real, const real, real&, quregister&, quregister&);
+        static void (*branch)       (const size_type, const real, real&, real&, quregister&, quregister&, quregister&);
+        static void (*permute)      (const size_type*, quregister&, quregister&);
+        static void (*gates)        (const gate*, const size_type, quregister&, quregister&);
+        static void (*normalize)    (quregister&, quregister&);
+        static void (*scale)        (const std::complex<real>, quregister&, quregister&);
+        static void (*phase_kick)   (const size_type, const real, quregister&, quregister&);
+        static void (*copy)         (quregister& input, quregister& output);
+        
+        //select implementation based on a name
+        static void implementation (std::string imp) {
+            if (imp == "omp")
+                QUANTUM_IMPLEMENTATION (openmp);
+            if (imp == "seq")
+                QUANTUM_IMPLEMENTATION (sequential);
+            if (imp == "tbb")
+                QUANTUM_IMPLEMENTATION (itbb);
+            if (imp == "tbb_mcp")
+                QUANTUM_IMPLEMENTATION (itbb_mcp);
+            if (imp == "tbb_blk")
+                QUANTUM_IMPLEMENTATION (itbb_blk);
+            if (imp == "tbb_rng")
+                QUANTUM_IMPLEMENTATION (itbb_range);
+            if (imp == "simd")
+                QUANTUM_IMPLEMENTATION (simd);
+        }
+    };
+    
+    template <class real>
+    void (*backend<real>::sigma_x)      (const size_type, basic_quregister<real>&, basic_quregister<real>&);
+    template <class real>
+    void (*backend<real>::sigma_z)      (const size_type, basic_quregister<real>&, basic_quregister<real>&);
+    template <class real>
+    void (*backend<real>::controlled_z) (const size_type, const size_type, basic_quregister<real>&, basic_quregister<real>&);
+    template <class real>
+    void (*backend<real>::diagonal)     (const size_type*, const size_type, basic_quregister<real>&, basic_quregister<real>&);
+    template <class real>
+    void (*backend<real>::kronecker)    (basic_quregister<real>&, basic_quregister<real>&, basic_quregister<real>&);
+    template <class real>
+    void (*backend<real>::expand)       (basic_quregister<real>&, basic_quregister<real>&);
+    template <class real>
+    int  (*backend<real>::measure)      (const size_type, const real, basic_quregister<real>&, basic_quregister<real>&);
+    template <class real>
+    int  (*backend<real>::sample)       (const size_type, const real, const real, real&, basic_quregister<real>&, basic_quregister<real>&);
+    template <class real>
+    void (*backend<real>::branch)       (const size_type, const real, real&, real&, basic_quregister<real>&, basic_quregister<real>&, basic_quregister<real>&);
+    template <class real>
+    void (*backend<real>::permute)      (const size_type*, basic_quregister<real>&, basic_quregister<real>&);
+    template <class real>
+    void (*backend<real>::gates)        (const gate*, const size_type, basic_quregister<real>&, basic_quregister<real>&);
+    template <class real>
+    void (*backend<real>::normalize)    (basic_quregister<real>&, basic_quregister<real>&);
+    template <class real>
+    void (*backend<real>::scale)        (const std::complex<real>, basic_quregister<real>&, basic_quregister<real>&);
+    template <class real>
+    void (*backend<real>::phase_kick)   (const size_type, const real, basic_quregister<real>&, basic_quregister<real>&);
+    template <class real>
+    void (*backend<real>::copy)         (basic_quregister<real>&, basic_quregister<real>&);
+    
+    //exported functions, in double precision:
+    void (*&sigma_x)      (const size_type, quregister&, quregister&)                   = backend<double>::sigma_x;
+    void (*&sigma_z)      (const size_type, quregister&, quregister&)                   = backend<double>::sigma_z;
+    void (*&controlled_z) (const size_type, const size_type, quregister&, quregister&)  = backend<double>::controlled_z;
+    void (*&diagonal)     (const size_type*, const size_type, quregister&, quregister&) = backend<double>::diagonal;
+    void (*&kronecker)    (quregister&, quregister&, quregister&)                       = backend<double>::kronecker;
+    void (*&expand)       (quregister&, quregister&)                                    = backend<double>::expand;
+    int  (*&measure)      (const size_type, const real, quregister&, quregister&)       = backend<double>::measure;
+    int  (*&sample)       (const size_type, const real, const real, real&, quregister&, quregister&) = backend<double>::sample;
+    void (*&branch)       (const size_type, const real, real&, real&, quregister&, quregister&, quregister&) = backend<double>::branch;
+    void (*&permute)      (const size_type*, quregister&, quregister&)                = backend<double>::permute;
+    void (*&gates)        (const gate*, const size_type, quregister&, quregister&)     = backend<double>::gates;
+    void (*&normalize)    (quregister&, quregister&)                                    = backend<double>::normalize;
+    void (*&scale)        (const complex, quregister&, quregister&)                     = backend<double>::scale;
+    void (*&phase_kick)   (const size_type, const real, quregister&, quregister&)       = backend<double>::phase_kick;
+    void (*&copy)         (quregister& input, quregister& output)                       = backend<double>::copy;
     
     //grainsize access
     void set_grainsize(size_type g) {
@@ -66,24 +156,15 @@ namespace quantum {
     }
     
 
-    //select implementation based on a name
+    //select implementation based on a name, for both precisions
     void implementation (std::string imp) {
-        if (imp == "omp")
-            QUANTUM_IMPLEMENTATION (openmp);
-        if (imp == "seq")
-            QUANTUM_IMPLEMENTATION (sequential);
-        if (imp == "tbb")
-            QUANTUM_IMPLEMENTATION (itbb);
-        if (imp == "tbb_mcp")
-            QUANTUM_IMPLEMENTATION (itbb_mcp);
-        if (imp == "tbb_blk")
-            QUANTUM_IMPLEMENTATION (itbb_blk);
-        if (imp == "tbb_rng")
-            QUANTUM_IMPLEMENTATION (itbb_range);
+        backend<float>::implementation(imp);
+        backend<double>::implementation(imp);
     }
     
     //output a quregister
-    std::ostream& operator << (std::ostream& out, const quregister& reg) {
+    template <class real>
+    std::ostream& operator << (std::ostream& out, const basic_quregister<real>& reg) {
         for (size_type i (0), n (reg.size()); i != n; ++i) {
             out << std::real(reg[i]) << " + " << std::imag(reg[i]) << "i |" << i << ">" << std::endl;
         }
@@ -91,7 +172,8 @@ namespace quantum {
     }
     
     //output a quregister
-    void print (const quregister& reg) {
+    template <class real>
+    void print (const basic_quregister<real>& reg) {
         std::cout << reg;
     }
 
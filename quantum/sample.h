@@ -0,0 +1,42 @@
+#ifndef pqvm_quantum_sample_h
+#define pqvm_quantum_sample_h
+
+#include "types.h"
+
+/*
+ * Sampled measurement.
+ * A sampled measurement projects the register on both branches in a single
+ * pass, and sums their norms along:
+ *
+ *     D0[j] = A[Ej] + A[Oj] * exp(-a*i)        outcome 0, |+alpha>
+ *     D1[j] = A[Ej] - A[Oj] * exp(-a*i)        outcome 1, |-alpha>
+ *
+ * The backends write D0 to the output and D1 to a scratch register, with
+ * branch, and return both squared norms; sample then picks the outcome here.
+ * Keeping both branches lets a caller follow the two outcomes at once.
+ */
+
+namespace quantum {
+
+    /*
+     * Outcome 1 iff u < p(1) = |D1|^2 / (|D0|^2 + |D1|^2), for u uniform in
+     * [0, 1). On outcome 1 the output and the scratch register are swapped,
+     * no amplitudes are copied. Returns the outcome, and its probability.
+     */
+    template <class real>
+    int choose (const real u, const real norm_plus, const real norm_minus, real& probability, basic_quregister<real>& output, basic_quregister<real>& minus) {
+        real total (norm_plus + norm_minus);
+        real p (total > 0 ? norm_minus / total : 1);
+        
+        if (u < p) {
+            output.swap(minus);
+            probability = p;
+            return 1;
+        }
+        probability = 1 - p;
+        return 0;
+    }
+
+}
+
+#endif
@@ -2,6 +2,10 @@
 #define pqvm_quantum_sequential_h
 
 #include "types.h"
+#include "diagonal.h"
+#include "sample.h"
+#include "permute.h"
+#include "gates.h"
 
 /*
  * A sequential quantum backend.
@@ -62,7 +66,8 @@ namespace quantum { namespace sequential {
      *
      */
     
-    void sigma_x (const size_type target, quregister& input, quregister& output) {
+    template <class real>
+    void sigma_x (const size_type target, basic_quregister<real>& input, basic_quregister<real>& output) {
         size_type   stride  (1 << target),
                     period  (2 * stride),
                     n       (input.size());
@@ -97,7 +102,8 @@ namespace quantum { namespace sequential {
      *
      */
     
-    void sigma_z (const size_type target, quregister& input, quregister& output) {
+    template <class real>
+    void sigma_z (const size_type target, basic_quregister<real>& input, basic_quregister<real>& output) {
         size_type   n       (input.size()),
                     mask    (1 << target);
         
@@ -124,7 +130,8 @@ namespace quantum { namespace sequential {
      */
 
     
-    void controlled_z (const size_type control, const size_type target, quregister& input, quregister& output) {
+    template <class real>
+    void controlled_z (const size_type control, const size_type target, basic_quregister<real>& input, basic_quregister<real>& output) {
         size_type   n       (input.size()),
                     mask    ((1 << control) | (1 << target));
         
@@ -135,6 +142,40 @@ namespace quantum { namespace sequential {
 
     };
     
+    /*
+     * Fused diagonal operators.
+     * Apply a run of Z and CZ operators, given as masks, in a single pass
+     * (see diagonal.h).
+     *
+     *     Z on 0, CZ on 1, 2
+     *
+     *         000 001 010 011 100 101 110 111
+     *        +---+---+---+---+---+---+---+---+
+     *     S: | A | B | C | D | E | F | G | H |
+     *        +---+---+---+---+---+---+---+---+
+     *          |   |   |   |   |   |   |   |
+     *        +---+---+---+---+---+---+---+---+
+     *     D: | A |-B | C |-D | E |-F |-G | H |
+     *        +---+---+---+---+---+---+---+---+
+     *
+     */
+    
+    template <class real>
+    void diagonal (const size_type* masks, const size_type count, basic_quregister<real>& input, basic_quregister<real>& output) {
+        size_type   n       (input.size()),
+                    cross;
+        sign_form   form    (masks, count, n);
+        
+        output.reserve(n);
+        
+        for (size_type i = 0; i < n;) {
+            //one block of amplitudes with the same high part
+            bool f = form.high(i, cross);
+            for (size_type end = i + form.low() + 1; i < end; ++i)
+                output[i] = form.sign(i, f, cross) ? -input[i] : input[i];
+        }
+    }
+    
     /*
      * Kronecker product.
      * Calculate the kronecker product of two vectors (size n and m).
@@ -143,7 +184,8 @@ namespace quantum { namespace sequential {
      * and then perform a double loop to calculate the results.
      */
     
-    void kronecker (quregister& left, quregister& right, quregister& result) {
+    template <class real>
+    void kronecker (basic_quregister<real>& left, basic_quregister<real>& right, basic_quregister<real>& result) {
         size_type   n   (left.size()),
                     m   (right.size());
         
@@ -154,6 +196,42 @@ namespace quantum { namespace sequential {
                 result[k] = left[i] * right[j];
     }
     
+    /*
+     * Expand.
+     * Tensor a |+> qubit behind the register, as the new target 0:
+     * |q> x |+>, the kronecker product with (1/sqrt(2), 1/sqrt(2)).
+     * Every amplitude is duplicated and scaled: D[2i] = D[2i+1] = S[i]/sqrt(2).
+     *
+     * When input and output are the same register and its capacity allows it,
+     * the expansion runs in place, back to front (D[2i] and D[2i+1] are never
+     * read after S[i]). Without the capacity, the register expands into a new
+     * allocation of twice its size.
+     */
+    
+    template <class real>
+    void expand (basic_quregister<real>& input, basic_quregister<real>& output) {
+        size_type   n       (input.size());
+        real        factor  (std::sqrt(0.5));
+        
+        if (input.begin() != output.begin()) {
+            output.reserve(2 * n);
+            for (size_type i = 0; i < n; ++i)
+                output[2 * i] = output[2 * i + 1] = input[i] * factor;
+            return;
+        }
+        
+        if (input.capacity() < 2 * n) {
+            basic_quregister<real> grown;
+            expand(input, grown);
+            input.swap(grown);
+            return;
+        }
+        
+        input.resize(2 * n);
+        for (size_type i = n; i > 0; --i)
+            input[2 * i - 2] = input[2 * i - 1] = input[i - 1] * factor;
+    }
+    
     /*
      * Measurement.
      * We measure in the (|+alpha>, |-alpha>) basis (on the equator of the
@@ -178,36 +256,144 @@ namespace quantum { namespace sequential {
      *        +---+---+---+---+
      *         00  01  10  11
      *     
-     *     even: D[j]  = A[Ej]
-     *     odd:  D[j] += - A[Oj] * exp(-a*i)
+     *     D[j]  = A[Ej] - A[Oj] * exp(-a*i)
+     *
+     * Both halves are handled in a single loop. As D[j] only depends on
+     * A[Ej] >= j and A[Oj] > j, an ascending loop also works in place, when
+     * input and output are the same register: the result is compacted into
+     * the first half, and the register is resized (keeping its capacity).
      *
      */
     
-    int measure (const size_type target, const real angle, quregister& input, quregister& output) {
+    template <class real>
+    int measure (const size_type target, const real angle, basic_quregister<real>& input, basic_quregister<real>& output) {
         size_type   n       (input.size()),
                     stride  (1 << target),
                     period  (stride * 2);
-        complex     factor  (std::exp(complex (0, -angle)));
+        std::complex<real>     factor  (std::exp(std::complex<real> (0, -angle)));
         
         output.reserve(n/2);
         
-        //even
         for (size_type i = 0, k = 0; i < n; i += period)
             for (size_type j = 0; j < stride; ++j, ++k)
-                output[k] = input[i + j];
+                output[k] = input[i + j] - input[i + j + stride] * factor;
         
-        //odd
-        for (size_type i = 0, k = 0; i < n; i += period)
-            for (size_type j = stride; j < period; ++j, ++k)
-                output[k] -= input[i + j] * factor;
+        if (input.begin() == output.begin())
+            output.resize(n/2);
         
         return 1;
     }
     
+    /*
+     * Sampled measurement (see sample.h).
+     * Measures the target qubit with a random outcome, in the same single
+     * loop as measure. The output is not renormalized: its norm is sqrt(2 p)
+     * times the norm of the input, the caller corrects with the returned
+     * probability p. Works in place, like measure.
+     */
+    
+    template <class real>
+    void branch (const size_type target, const real angle, real& norm_plus, real& norm_minus, basic_quregister<real>& input, basic_quregister<real>& output, basic_quregister<real>& minus) {
+        size_type   n       (input.size()),
+                    stride  (1 << target),
+                    period  (stride * 2);
+        std::complex<real>     factor  (std::exp(std::complex<real> (0, -angle)));
+        norm_plus = norm_minus = 0;
+        
+        output.reserve(n/2);
+        minus.reserve(n/2);
+        
+        for (size_type i = 0, k = 0; i < n; i += period)
+            for (size_type j = 0; j < stride; ++j, ++k) {
+                std::complex<real> even (input[i + j]),
+                                   odd  (input[i + j + stride] * factor);
+                output[k] = even + odd;
+                minus[k]  = even - odd;
+                norm_plus  += std::norm(output[k]);
+                norm_minus += std::norm(minus[k]);
+            }
+        
+        if (input.begin() == output.begin())
+            output.resize(n/2);
+    }
+    
+    template <class real>
+    int sample (const size_type target, const real angle, const real u, real& probability, basic_quregister<real>& input, basic_quregister<real>& output) {
+        basic_quregister<real> minus;
+        real norm_plus, norm_minus;
+        branch(target, angle, norm_plus, norm_minus, input, output, minus);
+        return choose(u, norm_plus, norm_minus, probability, output, minus);
+    }
+    
+    /*
+     * Qubit permutation.
+     * Move bit k of every index to bit map[k], one tile of the register at a
+     * time (see permute.h).
+     *
+     *     map 0 -> 1, 1 -> 0
+     *
+     *         00  01  10  11
+     *        +---+---+---+---+
+     *     S: | A | B | C | D |
+     *        +---+---+---+---+
+     *          |    \ /    |
+     *        +---+---+---+---+
+     *     D: | A | C | B | D |
+     *        +---+---+---+---+
+     *
+     */
+    
+    template <class real>
+    void permute (const size_type* map, basic_quregister<real>& input, basic_quregister<real>& output) {
+        size_type n (input.size()), in, out;
+        bit_permutation perm (map, n);
+        
+        output.reserve(n);
+        
+        for (size_type b = 0; b < perm.blocks(); ++b) {
+            perm.tile(b, in, out);
+            for (size_type t = 0; t < perm.size(); ++t)
+                output[out | perm.out(t)] = input[in | perm.in(t)];
+        }
+    }
+    
+    /*
+     * Gate lists.
+     * Apply a list of X, Z, CZ and phase kick gates in runs, each run tile by
+     * tile, so that a tile stays in cache for all gates of a run; X on a high
+     * target swaps pairs of tiles, in a pass of its own (see gates.h).
+     *
+     *     tile 0            tile 1            tile 2            tile 3
+     *    +-----------------+-----------------+-----------------+-----------------+
+     *    | Z 3, X 1, CZ 2 4| Z 3, X 1, CZ 2 4| Z 3, X 1, CZ 2 4| Z 3, X 1, CZ 2 4|
+     *    +-----------------+-----------------+-----------------+-----------------+
+     *
+     */
+    
+    template <class real>
+    void gates (const gate* list, const size_type count, basic_quregister<real>& input, basic_quregister<real>& output) {
+        size_type n (input.size());
+        gate_runs runs (list, count, n);
+        
+        output.reserve(n);
+        
+        //the first run reads the input, the others work in place
+        const std::complex<real>* in = input.begin();
+        for (size_type r = 0; r < runs.runs(); ++r, in = output.begin()) {
+            for (size_type b = 0; b < runs.blocks(r, n); ++b) {
+                if (runs.high(r))
+                    runs.cross(r, b, in, output.begin());
+                else
+                    runs.apply(r, b, in, output.begin());
+            }
+        }
+    }
+    
     /*
      * Copy.
      */
-    void copy (quregister& input, quregister& output) {
+    template <class real>
+    void copy (basic_quregister<real>& input, basic_quregister<real>& output) {
         size_type n (input.size());
         
         output.reserve(n);
@@ -221,7 +407,8 @@ namespace quantum { namespace sequential {
      * The sum of the amplitudes should equal 1.
      */
     
-    void normalize (quregister& input, quregister& output) {
+    template <class real>
+    void normalize (basic_quregister<real>& input, basic_quregister<real>& output) {
         size_type n (input.size());
         output.reserve(n);
         
@@ -236,13 +423,28 @@ namespace quantum { namespace sequential {
         else copy(input, output);
     }
     
+    /*
+     * Scale.
+     * Multiply every amplitude with a factor, e.g. a global phase.
+     */
+    
+    template <class real>
+    void scale (const std::complex<real> factor, basic_quregister<real>& input, basic_quregister<real>& output) {
+        size_type n (input.size());
+        output.reserve(n);
+        
+        for (size_type i = 0; i < n; ++i)
+            output[i] = factor * input[i];
+    }
+    
     /*
      * Phase-kick.
      */
-    void phase_kick (size_type target, real gamma, quregister& input, quregister& output) {
+    template <class real>
+    void phase_kick (size_type target, real gamma, basic_quregister<real>& input, basic_quregister<real>& output) {
         size_type   n       (input.size()),
                     mask    (1 << target);
-        complex     factor  (std::conj(std::exp(complex(0, gamma))));
+        std::complex<real>     factor  (std::conj(std::exp(std::complex<real>(0, gamma))));
         
         output.reserve(n);
         
@@ -0,0 +1,441 @@
+#ifndef pqvm_quantum_simd_h
+#define pqvm_quantum_simd_h
+
+#include "types.h"
+#include "tbb-blocks.h"
+#include <tbb/tbb.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define QUANTUM_SIMD_X86
+#include <immintrin.h>
+#endif
+
+/*
+ * A quantum backend with explicit SIMD kernels for the diagonal operators
+ * (Z, CZ and phase-kick), parallelized with TBB like the blocks backend.
+ * The other operators are taken from the blocks backend.
+ *
+ * The kernels are selected at runtime, in initialize(), depending on the
+ * CPU features: AVX-512, AVX2 (with FMA), or a scalar fallback.
+ */
+
+namespace quantum {
+
+    /*
+     * Diagonal kernels.
+     * All diagonal operators change the amplitudes i for which (i & m) == m,
+     * for a mask m of one or two target bits:
+     *
+     *     Z on t        flip the sign,         m = 2^t
+     *     CZ on c, t    flip the sign,         m = 2^c + 2^t
+     *     phase-kick    multiply by a factor,  m = 2^t
+     *
+     * A vector register holds L amplitudes (for double L = 2 with AVX2 and
+     * L = 4 with AVX-512, twice as many for float), starting at a multiple
+     * of L. The mask splits in a low part (bits < L), which gives a fixed
+     * per-lane pattern, and a high part, which selects entire vectors. The
+     * amplitudes with all high bits set form runs of length r = lowest high
+     * bit, which we visit run by run:
+     *
+     *     Z on t = 2, AVX2, double (L = 2, r = 4):
+     *
+     *         000 001 010 011 100 101 110 111
+     *        +---+---+---+---+---+---+---+---+
+     *     S: | A | B | C | D | E | F | G | H |
+     *        +---+---+---+---+---+---+---+---+
+     *        '<- skip run -->'<- flip run -->'
+     *        '       '       '<- v ->'<- v ->'
+     *
+     *     Z on t = 0, AVX2, double (no high part): XOR every vector with (+, -)
+     *
+     * A sign flip is an XOR of the sign bits. A phase multiply by (a + bi)
+     * uses per-lane factors (a, b) on the selected lanes and (1, 0) on the
+     * others: (x + yi)(a + bi) = (xa - yb) + (ya + xb)i, a single fmaddsub
+     * of the vector with a and its re/im swapped copy with b.
+     *
+     * The kernels are written once; the vector traits below map them onto
+     * the intrinsics for a real type and a vector width.
+     */
+
+    namespace kernels {
+
+        //end of the run containing i
+        inline size_type run_end (size_type i, size_type n, size_type high) {
+            if (!high) return n;
+            size_type run = high & (~high + 1),
+                      end = (i | (run - 1)) + 1;
+            return end < n ? end : n;
+        }
+
+        template <class real>
+        void flip_scalar (std::complex<real>* data, size_type i, size_type n, size_type mask) {
+            for (; i < n; ++i)
+                if ((i & mask) == mask)
+                    data[i] = -data[i];
+        }
+
+        template <class real>
+        void phase_scalar (std::complex<real>* data, size_type i, size_type n, size_type mask, std::complex<real> factor) {
+            for (; i < n; ++i)
+                if ((i & mask) == mask)
+                    data[i] *= factor;
+        }
+
+#ifdef QUANTUM_SIMD_X86
+
+        template <class real> struct avx2;
+        template <class real> struct avx512;
+
+#pragma GCC push_options
+#pragma GCC target("avx2,fma")
+
+        template <>
+        struct avx2<double> {
+            typedef __m256d type;
+            static const size_type lanes = 2;
+            static const bool aligned = basic_quregister<double>::alignment % 32 == 0;
+            static type load  (const double* p)          { return aligned ? _mm256_load_pd(p) : _mm256_loadu_pd(p); }
+            static void store (double* p, type v)        { aligned ? _mm256_store_pd(p, v) : _mm256_storeu_pd(p, v); }
+            static type flip  (type v, type sign)        { return _mm256_xor_pd(v, sign); }
+            static type swap  (type v)                   { return _mm256_permute_pd(v, 0x5); }
+            static type mul   (type v, type w)           { return _mm256_mul_pd(v, w); }
+            static type fmaddsub (type v, type a, type w) { return _mm256_fmaddsub_pd(v, a, w); }
+        };
+
+        template <>
+        struct avx2<float> {
+            typedef __m256 type;
+            static const size_type lanes = 4;
+            static const bool aligned = basic_quregister<float>::alignment % 32 == 0;
+            static type load  (const float* p)           { return aligned ? _mm256_load_ps(p) : _mm256_loadu_ps(p); }
+            static void store (float* p, type v)         { aligned ? _mm256_store_ps(p, v) : _mm256_storeu_ps(p, v); }
+            static type flip  (type v, type sign)        { return _mm256_xor_ps(v, sign); }
+            static type swap  (type v)                   { return _mm256_permute_ps(v, 0xB1); }
+            static type mul   (type v, type w)           { return _mm256_mul_ps(v, w); }
+            static type fmaddsub (type v, type a, type w) { return _mm256_fmaddsub_ps(v, a, w); }
+        };
+
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+
+        template <>
+        struct avx512<double> {
+            typedef __m512d type;
+            static const size_type lanes = 4;
+            static const bool aligned = basic_quregister<double>::alignment % 64 == 0;
+            static type load  (const double* p)          { return aligned ? _mm512_load_pd(p) : _mm512_loadu_pd(p); }
+            static void store (double* p, type v)        { aligned ? _mm512_store_pd(p, v) : _mm512_storeu_pd(p, v); }
+            static type flip  (type v, type sign) {
+                return _mm512_castsi512_pd(_mm512_xor_epi64(_mm512_castpd_si512(v), _mm512_castpd_si512(sign)));
+            }
+            static type swap  (type v)                   { return _mm512_shuffle_pd(v, v, 0x55); }
+            static type mul   (type v, type w)           { return _mm512_mul_pd(v, w); }
+            static type fmaddsub (type v, type a, type w) { return _mm512_fmaddsub_pd(v, a, w); }
+        };
+
+        template <>
+        struct avx512<float> {
+            typedef __m512 type;
+            static const size_type lanes = 8;
+            static const bool aligned = basic_quregister<float>::alignment % 64 == 0;
+            static type load  (const float* p)           { return aligned ? _mm512_load_ps(p) : _mm512_loadu_ps(p); }
+            static void store (float* p, type v)         { aligned ? _mm512_store_ps(p, v) : _mm512_storeu_ps(p, v); }
+            static type flip  (type v, type sign) {
+                return _mm512_castsi512_ps(_mm512_xor_epi32(_mm512_castps_si512(v), _mm512_castps_si512(sign)));
+            }
+            static type swap  (type v)                   { return _mm512_shuffle_ps(v, v, 0xB1); }
+            static type mul   (type v, type w)           { return _mm512_mul_ps(v, w); }
+            static type fmaddsub (type v, type a, type w) { return _mm512_fmaddsub_ps(v, a, w); }
+        };
+
+#pragma GCC pop_options
+
+        /*
+         * The vector kernels, for traits V over a real type.
+         * They are instantiated from the target-specific wrappers below,
+         * and always inlined there: the vector types never cross a call
+         * (which is what -Wpsabi warns about).
+         * The vector loops start on a multiple of the lanes, a whole vector
+         * from the start of the register: with registers aligned to the
+         * vector width (see vector.h) the loads and stores are aligned.
+         */
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpsabi"
+
+        template <class V, class real>
+        inline __attribute__((always_inline))
+        void flip_vector (std::complex<real>* data, size_type i, size_type n, size_type mask) {
+            const size_type lanes = V::lanes;
+            size_type low  = mask & (lanes - 1),
+                      high = mask & ~(lanes - 1);
+            alignas(64) real s[2 * lanes];
+            for (size_type l = 0; l < lanes; ++l)
+                s[2 * l] = s[2 * l + 1] = ((l & low) == low) ? -0.0 : 0.0;
+            typename V::type sign = V::load(s);
+
+            //scalar head, up to the first full vector
+            for (; i < n && (i % lanes); ++i)
+                if ((i & mask) == mask) data[i] = -data[i];
+
+            while (i < n) {
+                size_type end = run_end(i, n, high);
+                if ((i & high) == high) {
+                    for (; i + lanes <= end; i += lanes) {
+                        real* p = reinterpret_cast<real*>(data + i);
+                        V::store(p, V::flip(V::load(p), sign));
+                    }
+                    flip_scalar(data, i, end, mask);
+                }
+                i = end;
+            }
+        }
+
+        template <class V, class real>
+        inline __attribute__((always_inline))
+        void phase_vector (std::complex<real>* data, size_type i, size_type n, size_type mask, std::complex<real> factor) {
+            const size_type lanes = V::lanes;
+            size_type low  = mask & (lanes - 1),
+                      high = mask & ~(lanes - 1);
+            alignas(64) real fa[2 * lanes], fb[2 * lanes];
+            for (size_type l = 0; l < lanes; ++l) {
+                bool on = (l & low) == low;
+                fa[2 * l] = fa[2 * l + 1] = on ? factor.real() : 1;
+                fb[2 * l] = fb[2 * l + 1] = on ? factor.imag() : 0;
+            }
+            typename V::type a = V::load(fa),
+                             b = V::load(fb);
+
+            for (; i < n && (i % lanes); ++i)
+                if ((i & mask) == mask) data[i] *= factor;
+
+            while (i < n) {
+                size_type end = run_end(i, n, high);
+                if ((i & high) == high) {
+                    for (; i + lanes <= end; i += lanes) {
+                        real* p = reinterpret_cast<real*>(data + i);
+                        typename V::type v = V::load(p),
+                                         w = V::mul(V::swap(v), b);
+                        V::store(p, V::fmaddsub(v, a, w));
+                    }
+                    phase_scalar(data, i, end, mask, factor);
+                }
+                i = end;
+            }
+        }
+
+#pragma GCC diagnostic pop
+
+        template <class real>
+        __attribute__((target("avx2,fma")))
+        void flip_avx2 (std::complex<real>* data, size_type i, size_type n, size_type mask) {
+            flip_vector<avx2<real> >(data, i, n, mask);
+        }
+
+        template <class real>
+        __attribute__((target("avx2,fma")))
+        void phase_avx2 (std::complex<real>* data, size_type i, size_type n, size_type mask, std::complex<real> factor) {
+            phase_vector<avx2<real> >(data, i, n, mask, factor);
+        }
+
+        template <class real>
+        __attribute__((target("avx512f")))
+        void flip_avx512 (std::complex<real>* data, size_type i, size_type n, size_type mask) {
+            flip_vector<avx512<real> >(data, i, n, mask);
+        }
+
+        template <class real>
+        __attribute__((target("avx512f")))
+        void phase_avx512 (std::complex<real>* data, size_type i, size_type n, size_type mask, std::complex<real> factor) {
+            phase_vector<avx512<real> >(data, i, n, mask, factor);
+        }
+
+#endif
+
+    }
+
+}
+
+namespace quantum { namespace simd {
+
+    typedef tbb::blocked_range<size_type> range;
+
+    namespace details {
+
+        //the kernels for a real type, pointing to the widest the CPU supports
+        template <class real>
+        struct kernels {
+            typedef void (*flip_kernel)  (std::complex<real>*, size_type, size_type, size_type);
+            typedef void (*phase_kernel) (std::complex<real>*, size_type, size_type, size_type, std::complex<real>);
+
+            static flip_kernel  flip;
+            static phase_kernel phase;
+
+            static void select () {
+                flip  = &quantum::kernels::flip_scalar<real>;
+                phase = &quantum::kernels::phase_scalar<real>;
+#ifdef QUANTUM_SIMD_X86
+                __builtin_cpu_init();
+                if (__builtin_cpu_supports("avx512f")) {
+                    flip  = &quantum::kernels::flip_avx512<real>;
+                    phase = &quantum::kernels::phase_avx512<real>;
+                }
+                else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+                    flip  = &quantum::kernels::flip_avx2<real>;
+                    phase = &quantum::kernels::phase_avx2<real>;
+                }
+#endif
+            }
+        };
+
+        template <class real>
+        typename kernels<real>::flip_kernel  kernels<real>::flip  = &quantum::kernels::flip_scalar<real>;
+
+        template <class real>
+        typename kernels<real>::phase_kernel kernels<real>::phase = &quantum::kernels::phase_scalar<real>;
+
+        template <class real>
+        struct flip {
+            QUANTUM_TYPES(real);
+
+            const size_type mask;
+            complex* const data;
+
+            flip (size_type mask_, quregister& data_) :
+            mask (mask_), data (data_.begin()) {}
+
+            void operator() (const range& r) const {
+                kernels<real>::flip(data, r.begin(), r.end(), mask);
+            }
+        };
+
+        template <class real>
+        struct phase {
+            QUANTUM_TYPES(real);
+
+            const size_type mask;
+            const complex factor;
+            complex* const data;
+
+            phase (size_type mask_, complex factor_, quregister& data_) :
+            mask (mask_), factor (factor_), data (data_.begin()) {}
+
+            void operator() (const range& r) const {
+                kernels<real>::phase(data, r.begin(), r.end(), mask, factor);
+            }
+        };
+    }
+
+    /*
+     * Sigma-Z, controlled-Z and phase-kick work in place on the input register
+     * when the output is the same register; otherwise the input is copied first.
+     */
+
+    template <class real>
+    void sigma_z (const size_type target, basic_quregister<real>& input, basic_quregister<real>& output) {
+        if (input.begin() != output.begin())
+            itbb_blk::copy(input, output);
+
+        itbb_blk::partitioned_for(range (0, output.size(), grainsize),
+                                  details::flip<real> ((size_type)1 << target, output));
+    }
+
+    template <class real>
+    void controlled_z (const size_type control, const size_type target, basic_quregister<real>& input, basic_quregister<real>& output) {
+        if (input.begin() != output.begin())
+            itbb_blk::copy(input, output);
+
+        itbb_blk::partitioned_for(range (0, output.size(), grainsize),
+                                  details::flip<real> (((size_type)1 << control) | ((size_type)1 << target), output));
+    }
+
+    template <class real>
+    void phase_kick (size_type target, real gamma, basic_quregister<real>& input, basic_quregister<real>& output) {
+        if (input.begin() != output.begin())
+            itbb_blk::copy(input, output);
+
+        std::complex<real> factor (std::conj(std::exp(std::complex<real>(0, gamma))));
+        itbb_blk::partitioned_for(range (0, output.size(), grainsize),
+                                  details::phase<real> ((size_type)1 << target, factor, output));
+    }
+
+    /*
+     * Fused diagonal operators, from the blocks backend: the sign pattern
+     * of a run changes within a vector, there is no single flip mask.
+     */
+
+    template <class real>
+    void diagonal (const size_type* masks, const size_type count, basic_quregister<real>& input, basic_quregister<real>& output) {
+        itbb_blk::diagonal(masks, count, input, output);
+    }
+
+    /*
+     * Non-diagonal operators, from the blocks backend.
+     */
+
+    template <class real>
+    void sigma_x (const size_type target, basic_quregister<real>& input, basic_quregister<real>& output) {
+        itbb_blk::sigma_x(target, input, output);
+    }
+
+    template <class real>
+    void kronecker (basic_quregister<real>& left, basic_quregister<real>& right, basic_quregister<real>& result) {
+        itbb_blk::kronecker(left, right, result);
+    }
+
+    template <class real>
+    void expand (basic_quregister<real>& input, basic_quregister<real>& output) {
+        itbb_blk::expand(input, output);
+    }
+
+    template <class real>
+    int measure (const size_type target, const real angle, basic_quregister<real>& input, basic_quregister<real>& output) {
+        return itbb_blk::measure(target, angle, input, output);
+    }
+
+    template <class real>
+    void permute (const size_type* map, basic_quregister<real>& input, basic_quregister<real>& output) {
+        itbb_blk::permute(map, input, output);
+    }
+    
+    template <class real>
+    void gates (const gate* list, const size_type count, basic_quregister<real>& input, basic_quregister<real>& output) {
+        itbb_blk::gates(list, count, input, output);
+    }
+    
+    template <class real>
+    void branch (const size_type target, const real angle, real& norm_plus, real& norm_minus, basic_quregister<real>& input, basic_quregister<real>& output, basic_quregister<real>& minus) {
+        itbb_blk::branch(target, angle, norm_plus, norm_minus, input, output, minus);
+    }
+    
+    template <class real>
+    int sample (const size_type target, const real angle, const real u, real& probability, basic_quregister<real>& input, basic_quregister<real>& output) {
+        return itbb_blk::sample(target, angle, u, probability, input, output);
+    }
+
+    template <class real>
+    void normalize (basic_quregister<real>& input, basic_quregister<real>& output) {
+        itbb_blk::normalize(input, output);
+    }
+
+    template <class real>
+    void scale (const std::complex<real> factor, basic_quregister<real>& input, basic_quregister<real>& output) {
+        itbb_blk::scale(factor, input, output);
+    }
+
+    template <class real>
+    void copy (basic_quregister<real>& input, basic_quregister<real>& output) {
+        itbb_blk::copy(input, output);
+    }
+
+    void initialize () {
+        itbb_blk::initialize();
+        details::kernels<float>::select();
+        details::kernels<double>::select();
+    }
+
+} }
+
+#endif
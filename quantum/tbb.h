@@ -2,6 +2,10 @@
 #define pqvm_quantum_tbb_h
 
 #include "types.h"
+#include "diagonal.h"
+#include "sample.h"
+#include "permute.h"
+#include "gates.h"
 #include <tbb/tbb.h>
 
 /*
@@ -68,7 +72,10 @@ namespace quantum { namespace itbb {
     
     namespace details {
         
+        template <class real>
         struct sigma_x_even {
+            QUANTUM_TYPES(real);
+            
             const size_type target;
             const iterator input, output;
             
@@ -92,7 +99,10 @@ namespace quantum { namespace itbb {
             }
         };
         
+        template <class real>
         struct sigma_x_odd {
+            QUANTUM_TYPES(real);
+            
             const size_type target;
             const iterator input, output;
             
@@ -117,11 +127,12 @@ namespace quantum { namespace itbb {
         };
     }
     
-    void sigma_x (const size_type target, quregister& input, quregister& output) {
+    template <class real>
+    void sigma_x (const size_type target, basic_quregister<real>& input, basic_quregister<real>& output) {
         size_type n (input.size());
         output.reserve(n);
-        details::sigma_x_even even (target, input, output);
-        details::sigma_x_odd  odd  (target, input, output);
+        details::sigma_x_even<real> even (target, input, output);
+        details::sigma_x_odd<real>  odd  (target, input, output);
         
         tbb::parallel_for (range (0, n, grainsize), even);
         tbb::parallel_for (range (0, n, grainsize), odd);
@@ -145,7 +156,10 @@ namespace quantum { namespace itbb {
      */
     
     namespace details {
+        template <class real>
         struct sigma_z {
+            QUANTUM_TYPES(real);
+            
             const size_type mask;
             const iterator input, output;
             
@@ -162,10 +176,11 @@ namespace quantum { namespace itbb {
         };
     }
     
-    void sigma_z (const size_type target, quregister& input, quregister& output) {
+    template <class real>
+    void sigma_z (const size_type target, basic_quregister<real>& input, basic_quregister<real>& output) {
         size_type n (input.size());
         output.reserve(n);
-        tbb::parallel_for (range (0, n, grainsize), details::sigma_z (target, input, output));
+        tbb::parallel_for (range (0, n, grainsize), details::sigma_z<real> (target, input, output));
     }
     
     /*
@@ -185,7 +200,10 @@ namespace quantum { namespace itbb {
      */
     
     namespace details {
+        template <class real>
         struct controlled_z {
+            QUANTUM_TYPES(real);
+            
             const size_type mask;
             const iterator input, output;
             
@@ -201,12 +219,64 @@ namespace quantum { namespace itbb {
         };
     }
     
-    void controlled_z (const size_type control, const size_type target, quregister& input, quregister& output) {
+    template <class real>
+    void controlled_z (const size_type control, const size_type target, basic_quregister<real>& input, basic_quregister<real>& output) {
         size_type n (input.size());
         output.reserve(n);
-        tbb::parallel_for (range (0, n, grainsize), details::controlled_z (control, target, input, output));
+        tbb::parallel_for (range (0, n, grainsize), details::controlled_z<real> (control, target, input, output));
     };
     
+    /*
+     * Fused diagonal operators.
+     * Apply a run of Z and CZ operators, given as masks, in a single pass
+     * (see diagonal.h).
+     *
+     *     Z on 0, CZ on 1, 2
+     *
+     *         000 001 010 011 100 101 110 111
+     *        +---+---+---+---+---+---+---+---+
+     *     S: | A | B | C | D | E | F | G | H |
+     *        +---+---+---+---+---+---+---+---+
+     *          |   |   |   |   |   |   |   |
+     *        +---+---+---+---+---+---+---+---+
+     *     D: | A |-B | C |-D | E |-F |-G | H |
+     *        +---+---+---+---+---+---+---+---+
+     *
+     */
+    
+    namespace details {
+        template <class real>
+        struct diagonal {
+            QUANTUM_TYPES(real);
+            
+            const sign_form& form;
+            const iterator input, output;
+            
+            diagonal (const sign_form& form_, quregister& input_, quregister& output_) :
+            form (form_), input (input_.begin()), output (output_.begin()) {}
+            
+            void operator() (const range& r) const {
+                size_type cross;
+                for (size_type i = r.begin(), n = r.end(); i < n;) {
+                    //one block of amplitudes with the same high part
+                    bool f = form.high(i, cross);
+                    for (size_type end = std::min(n, (i | form.low()) + 1); i < end; ++i)
+                        output[i] = form.sign(i, f, cross) ? -input[i] : input[i];
+                }
+            }
+        };
+    }
+    
+    template <class real>
+    void diagonal (const size_type* masks, const size_type count, basic_quregister<real>& input, basic_quregister<real>& output) {
+        size_type n (input.size());
+        sign_form form (masks, count, n);
+        
+        output.reserve(n);
+        
+        tbb::parallel_for (range (0, n, grainsize), details::diagonal<real> (form, input, output));
+    }
+    
     /*
      * Kronecker product.
      * Calculate the kronecker product of two vectors (size n and m).
@@ -216,7 +286,10 @@ namespace quantum { namespace itbb {
      */
     
     namespace details {
+        template <class real>
         struct kronecker {
+            QUANTUM_TYPES(real);
+            
             const size_type m;
             const iterator left, right, result;
             
@@ -231,13 +304,72 @@ namespace quantum { namespace itbb {
         };
     }
     
-    void kronecker (quregister& left, quregister& right, quregister& result) {
+    template <class real>
+    void kronecker (basic_quregister<real>& left, basic_quregister<real>& right, basic_quregister<real>& result) {
         result.reserve(left.size() * right.size());
-        details::kronecker k (left, right, result);
+        details::kronecker<real> k (left, right, result);
         
         tbb::parallel_for(range (0, left.size(), grainsize),  k);
     }
     
+    /*
+     * Expand.
+     * Tensor a |+> qubit behind the register, as the new target 0:
+     * |q> x |+>, the kronecker product with (1/sqrt(2), 1/sqrt(2)).
+     * Every amplitude is duplicated and scaled: D[2i] = D[2i+1] = S[i]/sqrt(2).
+     *
+     * When input and output are the same register and its capacity allows it,
+     * the expansion runs in place, back to front: for m = n/2, n/4 ... 1 the
+     * round [m, 2m) writes [2m, 4m), which was read by the previous round, so
+     * every round is a parallel loop without conflicts. Without the capacity,
+     * the register expands into a new allocation of twice its size.
+     */
+    
+    namespace details {
+        template <class real>
+        struct expand {
+            QUANTUM_TYPES(real);
+            
+            const real factor;
+            const iterator input, output;
+            
+            expand (quregister& input_, quregister& output_) :
+            factor (std::sqrt(0.5)), input (input_.begin()), output (output_.begin()) {}
+            
+            void operator() (const range& r) const {
+                for (size_type i (r.begin()); i < r.end(); ++i) {
+                    complex amplitude (input[i] * factor);
+                    output[2 * i]     = amplitude;
+                    output[2 * i + 1] = amplitude;
+                }
+            }
+        };
+    }
+    
+    template <class real>
+    void expand (basic_quregister<real>& input, basic_quregister<real>& output) {
+        size_type n (input.size());
+        
+        if (input.begin() != output.begin()) {
+            output.reserve(2 * n);
+            tbb::parallel_for(range (0, n, grainsize), details::expand<real> (input, output));
+            return;
+        }
+        
+        if (input.capacity() < 2 * n) {
+            basic_quregister<real> grown (2 * n);
+            tbb::parallel_for(range (0, n, grainsize), details::expand<real> (input, grown));
+            input.swap(grown);
+            return;
+        }
+        
+        input.resize(2 * n);
+        details::expand<real> e (input, input);
+        for (size_type m = n / 2; m > 0; m >>= 1)
+            tbb::parallel_for(range (m, 2 * m, grainsize), e);
+        e(range (0, 1));
+    }
+    
     /*
      * Measurement.
      * We measure in the (|+alpha>, |-alpha>) basis (on the equator of the
@@ -272,7 +404,10 @@ namespace quantum { namespace itbb {
         
         void test () {}
         
+        template <class real>
         struct measure_even {
+            QUANTUM_TYPES(real);
+            
             const size_type target;
             const real angle;
             const iterator input, output;
@@ -296,7 +431,10 @@ namespace quantum { namespace itbb {
             }
         };
         
+        template <class real>
         struct measure_odd {
+            QUANTUM_TYPES(real);
+            
             const size_type target;
             const real angle;
             const iterator input, output;
@@ -323,12 +461,13 @@ namespace quantum { namespace itbb {
         };
     }
     
-    int measure (const size_type target, const real angle, quregister& input, quregister& output) {
+    template <class real>
+    int measure (const size_type target, const real angle, basic_quregister<real>& input, basic_quregister<real>& output) {
         size_type n (input.size() / 2);
         output.reserve(n);
         
-        details::measure_even even (target, angle, input, output);
-        details::measure_odd  odd  (target, angle, input, output);
+        details::measure_even<real> even (target, angle, input, output);
+        details::measure_odd<real>  odd  (target, angle, input, output);
         
         tbb::parallel_for(range (0, n, grainsize), even);
         tbb::parallel_for(range (0, n, grainsize), odd);
@@ -336,12 +475,192 @@ namespace quantum { namespace itbb {
         return 1;
     }
     
+    /*
+     * Sampled measurement (see sample.h).
+     * Both branches in one parallel reduction, which sums their norms.
+     */
+    
+    namespace details {
+        
+        template <class real>
+        struct sample {
+            QUANTUM_TYPES(real);
+            
+            const size_type target;
+            const complex factor;
+            const iterator input, plus, minus;
+            real norm_plus, norm_minus;
+            
+            sample (size_type target_, real angle_, quregister& input_, quregister& plus_, quregister& minus_) :
+            target (target_), factor (std::exp(complex (0, -angle_))),
+            input (input_.begin()), plus (plus_.begin()), minus (minus_.begin()),
+            norm_plus (0), norm_minus (0) {}
+            
+            sample (sample& origin, tbb::split) :
+            target (origin.target), factor (origin.factor),
+            input (origin.input), plus (origin.plus), minus (origin.minus),
+            norm_plus (0), norm_minus (0) {}
+            
+            void operator() (const range& r) {
+                size_type stride (1 << target),
+                period (stride << 1),
+                i      (r.begin()),
+                j      ((i / stride) * period + (i % stride));
+                
+                while (i < r.end()) {
+                    complex even (input[j]),
+                            odd  (input[j + stride] * factor);
+                    plus[i]  = even + odd;
+                    minus[i] = even - odd;
+                    norm_plus  += std::norm(plus[i]);
+                    norm_minus += std::norm(minus[i]);
+                    ++i;
+                    ++j;
+                    if (i % stride) continue;
+                    else j+= stride;
+                }
+            }
+            
+            void join (sample& rhs) {
+                norm_plus  += rhs.norm_plus;
+                norm_minus += rhs.norm_minus;
+            }
+        };
+    }
+    
+    template <class real>
+    void branch (const size_type target, const real angle, real& norm_plus, real& norm_minus, basic_quregister<real>& input, basic_quregister<real>& output, basic_quregister<real>& minus) {
+        size_type n (input.size() / 2);
+        output.reserve(n);
+        minus.reserve(n);
+        
+        details::sample<real> body (target, angle, input, output, minus);
+        tbb::parallel_reduce(range (0, n, grainsize), body);
+        
+        norm_plus  = body.norm_plus;
+        norm_minus = body.norm_minus;
+    }
+    
+    template <class real>
+    int sample (const size_type target, const real angle, const real u, real& probability, basic_quregister<real>& input, basic_quregister<real>& output) {
+        basic_quregister<real> minus;
+        real norm_plus, norm_minus;
+        branch(target, angle, norm_plus, norm_minus, input, output, minus);
+        return choose(u, norm_plus, norm_minus, probability, output, minus);
+    }
+    
+    /*
+     * Qubit permutation.
+     * Move bit k of every index to bit map[k], one tile of the register at a
+     * time (see permute.h).
+     *
+     *     map 0 -> 1, 1 -> 0
+     *
+     *         00  01  10  11
+     *        +---+---+---+---+
+     *     S: | A | B | C | D |
+     *        +---+---+---+---+
+     *          |    \ /    |
+     *        +---+---+---+---+
+     *     D: | A | C | B | D |
+     *        +---+---+---+---+
+     *
+     */
+    
+    namespace details {
+        template <class real>
+        struct permute {
+            QUANTUM_TYPES(real);
+            
+            const bit_permutation& perm;
+            const iterator input, output;
+            
+            permute (const bit_permutation& perm_, quregister& input_, quregister& output_) :
+            perm (perm_), input (input_.begin()), output (output_.begin()) {}
+            
+            void operator() (const range& r) const {
+                size_type in, out;
+                for (size_type b = r.begin(); b < r.end(); ++b) {
+                    //one tile
+                    perm.tile(b, in, out);
+                    for (size_type t = 0; t < perm.size(); ++t)
+                        output[out | perm.out(t)] = input[in | perm.in(t)];
+                }
+            }
+        };
+    }
+    
+    template <class real>
+    void permute (const size_type* map, basic_quregister<real>& input, basic_quregister<real>& output) {
+        size_type n (input.size());
+        bit_permutation perm (map, n);
+        
+        output.reserve(n);
+        
+        //the grainsize counts amplitudes, the range counts tiles
+        tbb::parallel_for (range (0, perm.blocks(), grainsize / perm.size() + 1), details::permute<real> (perm, input, output));
+    }
+    
+    /*
+     * Gate lists.
+     * Apply a list of X, Z, CZ and phase kick gates in runs, each run tile by
+     * tile, so that a tile stays in cache for all gates of a run; X on a high
+     * target swaps pairs of tiles, in a pass of its own (see gates.h).
+     *
+     *     tile 0            tile 1            tile 2            tile 3
+     *    +-----------------+-----------------+-----------------+-----------------+
+     *    | Z 3, X 1, CZ 2 4| Z 3, X 1, CZ 2 4| Z 3, X 1, CZ 2 4| Z 3, X 1, CZ 2 4|
+     *    +-----------------+-----------------+-----------------+-----------------+
+     *
+     */
+    
+    namespace details {
+        template <class real>
+        struct gates {
+            QUANTUM_TYPES(real);
+            
+            const gate_runs& runs;
+            const size_type run;
+            const complex* input;
+            complex* output;
+            
+            gates (const gate_runs& runs_, const size_type run_, const complex* input_, quregister& output_) :
+            runs (runs_), run (run_), input (input_), output (output_.begin()) {}
+            
+            void operator() (const range& r) const {
+                for (size_type b = r.begin(); b < r.end(); ++b) {
+                    if (runs.high(run))
+                        runs.cross(run, b, input, output);
+                    else
+                        runs.apply(run, b, input, output);
+                }
+            }
+        };
+    }
+    
+    template <class real>
+    void gates (const gate* list, const size_type count, basic_quregister<real>& input, basic_quregister<real>& output) {
+        size_type n (input.size());
+        gate_runs runs (list, count, n);
+        
+        output.reserve(n);
+        
+        //the first run reads the input, the others work in place; the
+        //grainsize counts amplitudes, the range counts tiles
+        const std::complex<real>* in = input.begin();
+        for (size_type r = 0; r < runs.runs(); ++r, in = output.begin())
+            tbb::parallel_for (range (0, runs.blocks(r, n), grainsize / runs.tile() + 1), details::gates<real> (runs, r, in, output));
+    }
+    
     /*
      * Copy.
      */
     namespace details {
         
+        template <class real>
         struct copy {
+            QUANTUM_TYPES(real);
+            
             iterator input, output;
             
             copy (quregister& input_, quregister& output_) :
@@ -356,12 +675,13 @@ namespace quantum { namespace itbb {
         
     }
     
-    void copy (quregister& input, quregister& output) {
+    template <class real>
+    void copy (basic_quregister<real>& input, basic_quregister<real>& output) {
         size_type n (input.size());
         
         output.reserve(n);
         
-        tbb::parallel_for(range (0, n, grainsize), details::copy (input, output));
+        tbb::parallel_for(range (0, n, grainsize), details::copy<real> (input, output));
     }
     
     void initialize () {
@@ -374,7 +694,10 @@ namespace quantum { namespace itbb {
      */
     
     namespace details {
+        template <class real>
         struct norm {
+            QUANTUM_TYPES(real);
+            
             real total;
             iterator input;
             norm (quregister& input_) :
@@ -394,7 +717,10 @@ namespace quantum { namespace itbb {
             
         };
         
+        template <class real>
         struct normalize {
+            QUANTUM_TYPES(real);
+            
             real norm;
             iterator input, output;
             
@@ -408,25 +734,60 @@ namespace quantum { namespace itbb {
         };
     }
     
-    void normalize (quregister& input, quregister& output) {
+    template <class real>
+    void normalize (basic_quregister<real>& input, basic_quregister<real>& output) {
         size_type n (input.size());
         output.reserve(n);
         real limit = 1.0e-8;
         
-        details::norm norm (input);
+        details::norm<real> norm (input);
         
         tbb::parallel_reduce(range (0, n, grainsize), norm);
         if (std::abs(1 - norm.total) > limit)
-            tbb::parallel_for(range (0, n, grainsize), details::normalize (norm.total, input, output));
+            tbb::parallel_for(range (0, n, grainsize), details::normalize<real> (norm.total, input, output));
         else copy(input, output);
     }
     
+    /*
+     * Scale.
+     * Multiply every amplitude with a factor, e.g. a global phase.
+     */
+    
+    namespace details {
+        template <class real>
+        struct scale {
+            QUANTUM_TYPES(real);
+            
+            complex factor;
+            iterator input, output;
+            
+            scale (const complex f, quregister& input_, quregister& output_) :
+            factor(f), input(input_.begin()), output(output_.begin()) {}
+            
+            void operator () (const range& r) const {
+                for (size_type i (r.begin()); i < r.end(); ++i)
+                    output[i] = factor * input[i];
+            }
+        };
+    }
+    
+    template <class real>
+    void scale (const std::complex<real> factor, basic_quregister<real>& input, basic_quregister<real>& output) {
+        size_type n (input.size());
+        output.reserve(n);
+        
+        tbb::parallel_for(range (0, n, grainsize), details::scale<real> (factor, input, output));
+    }
+    
     /*
      * Phase-kick.
      */
     
     namespace details {
+        template <class real>
         struct phase_kick {
+            QUANTUM_TYPES(real);
+            
             size_type target;
             real gamma;
             iterator input, output;
@@ -446,12 +807,13 @@ namespace quantum { namespace itbb {
         
     }
     
-    void phase_kick (size_type target, real gamma, quregister& input, quregister& output) {
+    template <class real>
+    void phase_kick (size_type target, real gamma, basic_quregister<real>& input, basic_quregister<real>& output) {
         size_type n (input.size());
         
         output.reserve(n);
         
-        tbb::parallel_for(range (0, n, grainsize), details::phase_kick (target, gamma, input, output));
+        tbb::parallel_for(range (0, n, grainsize), details::phase_kick<real> (target, gamma, input, output));
     }
     
 } }
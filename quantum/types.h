@@ -3,19 +3,49 @@
 
 #include <complex>
 #include "../vector.h"
+#include "../pool.h"
+#include "../numa_allocator.h"
 
 /*
  * Define the basic quantum types we use throughout th implementation
  */
 
 namespace quantum {
-    
-    typedef double real;
-    typedef std::complex<real> complex;
-    typedef vector<complex> quregister;
-    typedef quregister::iterator iterator;
-    typedef quregister::size_type size_type;
-    
+
+    /*
+     * The backends are templated on the real type of the amplitudes:
+     * a register of floats takes 8 bytes per amplitude instead of 16,
+     * which halves the memory (traffic) of every operator.
+     */
+    template <class real>
+    using basic_quregister = vector<std::complex<real>, pool_allocator<std::complex<real>, numa_allocator<std::complex<real> > > >;
+
+    template <class R>
+    struct types {
+        typedef R real;
+        typedef std::complex<real> complex;
+        typedef pool_allocator<complex, numa_allocator<complex> > allocator;
+        typedef basic_quregister<real> quregister;
+        typedef typename quregister::iterator iterator;
+        typedef typename quregister::size_type size_type;
+    };
+
+    //double precision, unless stated otherwise
+    typedef types<double>::real real;
+    typedef types<double>::complex complex;
+    typedef types<double>::allocator allocator;
+    typedef types<double>::quregister quregister;
+    typedef types<double>::iterator iterator;
+    typedef types<double>::size_type size_type;
+
 }
 
-#endif
\ No newline at end of file
+/*
+ * Import the types for the template parameter real into a functor.
+ */
+#define QUANTUM_TYPES(real)                                         \
+    typedef typename quantum::types<real>::complex    complex;      \
+    typedef typename quantum::types<real>::quregister quregister;   \
+    typedef typename quantum::types<real>::iterator   iterator
+
+#endif
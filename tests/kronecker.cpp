@@ -20,6 +20,8 @@ using namespace quantum;
  *   g  grainsize
  *   s  random seed, to obtain same results twice
  *   p  explicitly set the number of threads
+ *   H  map the registers on huge pages
+ *   N  NUMA placement of the registers: none, interleave or touch
  */
 
 int main (int argc, char** argv) {
@@ -37,7 +39,7 @@ int main (int argc, char** argv) {
     
     //get options
     int option;
-    while ((option = getopt (argc, argv, "q:r:i:f:p:vg:s:")) != -1) {
+    while ((option = getopt (argc, argv, "q:r:i:f:p:vg:s:HN:")) != -1) {
         switch (option) {
             case 'q':
                 num_qubits = parseopt<int>();
@@ -58,6 +60,15 @@ int main (int argc, char** argv) {
             case 'v':
                 verbose = true;
                 break;
+            case 'H':
+                pages::huge() = true;
+                break;
+            case 'N':
+                if (!numa::select(parseopt<std::string>())) {
+                    std::cerr << "unknown placement, use none, interleave or touch" << std::endl;
+                    return 1;
+                }
+                break;
             case 'g':
                 set_grainsize(parseopt<size_type>());
                 break;
@@ -116,6 +127,7 @@ int main (int argc, char** argv) {
             kronecker(a, b, c);
         }
     
+    if (verbose) pages::report(stdout);
     return 0;
     
 }
@@ -0,0 +1,164 @@
+#include <string>
+#include <iostream>
+#include <cstdlib>
+#include <ctime>
+
+#include "../performance.h"
+#include "../quantum/quantum.h"
+#include "../options.h"
+
+using namespace quantum;
+
+/*
+ * The the performance of the measurement operator
+ * options:
+ *   q  number of qubits
+ *   r  number of iterations (set high to overcome init times)
+ *   i  select  quantum backend implementation
+ *   f  output filename
+ *   t  target qubit number
+ *   a  measurement angle
+ *   v  verbose output
+ *   g  grainsize
+ *   s  random seed, to obtain same results twice
+ *   o  display the statevector (before and after) output on screen
+ *   p  explicitly set the number of threads
+ *   H  map the registers on huge pages
+ *   N  NUMA placement of the registers: none, interleave or touch
+ */
+
+int main (int argc, char** argv) {
+    
+    //default options
+    int num_qubits = 20; //q
+    int num_repeat = 1;  //r
+    std::string imp = "tbb_blk"; //i
+    std::string file = "measure-speedup.data"; //f
+    bool measure = false; //f
+    size_type target = 10; //t
+    real angle = 0.5; //a
+    bool verbose = false; //v
+    set_grainsize (512); //g
+    uint seed = (uint)time(NULL); //s
+    bool output = false; //o
+    
+    //get options
+    int option;
+    while ((option = getopt (argc, argv, "q:r:i:f:p:t:a:vg:s:oHN:")) != -1) {
+        switch (option) {
+            case 'q':
+                num_qubits = parseopt<int>();
+                break;
+            case 'r':
+                num_repeat = parseopt<int>();
+                break;
+            case 'i':
+                imp = parseopt<std::string>();
+                break;
+            case 'f':
+                measure = true;
+                file = parseopt<std::string>();
+                break;
+            case 'p':
+                performance::set_threads(parseopt<int>());
+                break;
+            case 't':
+                target = parseopt<size_type>();
+                break;
+            case 'a':
+                angle = parseopt<real>();
+                break;
+            case 'v':
+                verbose = true;
+                break;
+            case 'H':
+                pages::huge() = true;
+                break;
+            case 'N':
+                if (!numa::select(parseopt<std::string>())) {
+                    std::cerr << "unknown placement, use none, interleave or touch" << std::endl;
+                    return 1;
+                }
+                break;
+            case 'g':
+                set_grainsize(parseopt<size_type>());
+                break;
+            case 's':
+                seed = parseopt<uint>();
+                break;
+            case 'o':
+                output = true;
+                break;
+        }
+    }
+    
+    /*
+     * Initialize random state
+     * use a seed for repeatable results.
+     */
+    srand(seed);
+    
+    implementation(imp);
+    
+    size_type size = 1 << num_qubits;
+    
+    quregister a (1 << num_qubits),
+               b;
+    
+    //tbb_blk measures in place, like pqvm calls it: the register
+    //shrinks to half its size, so restore the size every iteration
+    bool in_place = (imp == "tbb_blk");
+    quregister& out = in_place ? a : b;
+    
+    for (iterator i (a.begin()); i < a.end(); ++i) {
+        *i = complex ((rand() % 100) / 100.0, (rand() % 100) / 100.0);
+    }
+    
+    /*
+     * initilaize the performance counters
+     */
+    performance::init();
+    
+    if (verbose) {
+        std::cout
+            << "Running measure on "
+            << num_qubits << " qubits, target qubit "
+            << target << ", angle " << angle << std::endl
+            << "State vector contains "
+            << size << " amplitudes, "
+            << ((double)(size* sizeof(complex)) / (1024*1024))
+            << "MiB" << std::endl;
+    }
+    
+    /*
+     * Either measure the speedup (if output file is give)
+     * Of just execute th operator (for external measurements with PERF
+     * or correctness testing.
+     */
+    if (measure) {
+        if (imp != "seq" && imp != "omp")
+            measure_parallel (file, num_repeat, verbose) {
+                if (in_place) a.resize(size);
+                quantum::measure(target, angle, a, out);
+            }
+        
+        else
+            measure_sequential (file, num_repeat, verbose) {
+                if (in_place) a.resize(size);
+                quantum::measure(target, angle, a, out);
+            }
+    }
+    
+    else {
+        if (output) print(a);
+        for (int i = 1;num_repeat > 0; --num_repeat) {
+            if (verbose) std::cout << "iteration " << i++ << std::endl;
+            if (in_place) a.resize(size);
+            quantum::measure(target, angle, a, out);
+        }
+        if (output) print(out);
+    }
+    if (verbose) pages::report(stdout);
+    return 0;
+    
+}
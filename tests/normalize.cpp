@@ -22,6 +22,8 @@ using namespace quantum;
  *   s  random seed, to obtain same results twice
  *   o  display the statevector (before and after) output on screen
  *   p  explicitly set the number of threads
+ *   H  map the registers on huge pages
+ *   N  NUMA placement of the registers: none, interleave or touch
  */
 
 int main (int argc, char** argv) {
@@ -39,7 +41,7 @@ int main (int argc, char** argv) {
     
     //get options
     int option;
-    while ((option = getopt (argc, argv, "q:r:i:f:p:vg:s:o")) != -1) {
+    while ((option = getopt (argc, argv, "q:r:i:f:p:vg:s:oHN:")) != -1) {
         switch (option) {
             case 'q':
                 num_qubits = parseopt<int>();
@@ -60,6 +62,15 @@ int main (int argc, char** argv) {
             case 'v':
                 verbose = true;
                 break;
+            case 'H':
+                pages::huge() = true;
+                break;
+            case 'N':
+                if (!numa::select(parseopt<std::string>())) {
+                    std::cerr << "unknown placement, use none, interleave or touch" << std::endl;
+                    return 1;
+                }
+                break;
             case 'g':
                 set_grainsize(parseopt<size_type>());
                 break;
@@ -122,6 +133,7 @@ int main (int argc, char** argv) {
         }
         if (output) {if (imp == "tbb_blk") print(a); else print(b);}
     }
+    if (verbose) pages::report(stdout);
     return 0;
     
 }
\ No newline at end of file
@@ -22,6 +22,8 @@ using namespace quantum;
  *   s  random seed, to obtain same results twice
  *   o  display the statevector (before and after) output on screen
  *   p  explicitly set the number of threads
+ *   H  map the registers on huge pages
+ *   N  NUMA placement of the registers: none, interleave or touch
  */
 
 int main (int argc, char** argv) {
@@ -40,7 +42,7 @@ int main (int argc, char** argv) {
     
     //get options
     int option;
-    while ((option = getopt (argc, argv, "q:r:i:f:p:t:vg:s:o")) != -1) {
+    while ((option = getopt (argc, argv, "q:r:i:f:p:t:vg:s:oHN:")) != -1) {
         switch (option) {
             case 'q':
                 num_qubits = parseopt<int>();
@@ -64,6 +66,15 @@ int main (int argc, char** argv) {
             case 'v':
                 verbose = true;
                 break;
+            case 'H':
+                pages::huge() = true;
+                break;
+            case 'N':
+                if (!numa::select(parseopt<std::string>())) {
+                    std::cerr << "unknown placement, use none, interleave or touch" << std::endl;
+                    return 1;
+                }
+                break;
             case 'g':
                 set_grainsize(parseopt<size_type>());
                 break;
@@ -89,6 +100,9 @@ int main (int argc, char** argv) {
     quregister a (1 << num_qubits),
     b;
     
+    //tbb_blk and simd work in place, like pqvm calls them
+    quregister& out = (imp == "tbb_blk" || imp == "simd") ? a : b;
+    
     for (iterator i (a.begin()); i < a.end(); ++i) {
         *i = complex ((rand() % 100) / 100.0, (rand() % 100) / 100.0);
     }
@@ -116,21 +130,22 @@ int main (int argc, char** argv) {
     if (measure) {
         if (imp != "seq" && imp != "omp")
             measure_parallel (file, num_repeat, verbose)
-            sigma_z(target, a, b);
+            sigma_z(target, a, out);
         
         else
             measure_sequential (file, num_repeat, verbose)
-            sigma_z(target, a, b);
+            sigma_z(target, a, out);
     }
     
     else {
         if (output) print(a);
         for (int i = 1;num_repeat > 0; --num_repeat) {
             if (verbose) std::cout << "iteration " << i++ << std::endl;
-            sigma_z(target, a, b);
+            sigma_z(target, a, out);
         }
-        if (output) {if (imp == "tbb_blk") print(a); else print(b);}
+        if (output) print(out);
     }
+    if (verbose) pages::report(stdout);
     return 0;
     
 }
\ No newline at end of file
@@ -1,12 +1,56 @@
 #ifndef pqvm_vector_h
 #define pqvm_vector_h
 
+#include <algorithm>
+#include <cstdlib>
 #include <iostream>
 #include <memory>
+#include <new>
 #include <stdexcept>
 
+/*
+ * The default alignment of vector storage, in bytes: one cache line.
+ * Build with -DPQVM_ALIGNMENT=128 (a power of two, at least the size of a
+ * pointer) to change it.
+ */
+#ifndef PQVM_ALIGNMENT
+#define PQVM_ALIGNMENT 64
+#endif
+
+/**
+ * Allocator aligning every allocation to Alignment bytes.
+ * A vector of complex amplitudes then starts on a cache line, the SIMD
+ * kernels load and store whole vectors without straddling two lines, and
+ * the blocks the parallel loops cut at cache line multiples are aligned.
+ */
+
+template <class T, std::size_t Alignment = PQVM_ALIGNMENT>
+class aligned_allocator {
+public:
+    typedef T value_type;
+    typedef std::size_t size_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef T* pointer;
+    typedef const T* const_pointer;
+
+    static const size_type alignment = Alignment;
+
+    inline pointer allocate (const size_type n) {
+        void* p = NULL;
+        if (posix_memalign(&p, alignment, n * sizeof(T)) != 0)
+            throw std::bad_alloc ();
+        return (pointer)p;
+    }
+
+    inline void deallocate (pointer p, const size_type) {
+        free(p);
+    }
+};
+
 /**
  * Fixed-length vector of objects of type T.
+ * The allocator A is the alignment policy: the storage starts on a multiple
+ * of A::alignment bytes.
  * @WARNING Contrary to the std::vector, this container does not
  * construct or destruct its members. This container is desinged
  * primarily with numeric or simple compound types in mind, and
@@ -14,7 +58,7 @@
  * performance.
  */
 
-template <class T, class A = std::allocator<T> >
+template <class T, class A = aligned_allocator<T> >
 class vector {
 private:
     typedef vector<T, A> self_type;
@@ -36,10 +80,13 @@ public:
     typedef typename allocator_type::const_pointer const_pointer;
     typedef pointer iterator;
     typedef const_pointer const_iterator;
+    
+    static const size_type alignment = allocator_type::alignment;
 
 private:
     pointer  _begin;
     pointer  _end;
+    pointer  _end_of_storage;
     allocator_type _alloc;
 
 public:
@@ -48,47 +95,90 @@ public:
      * Allocate: allocate space for n elements, or wait for allocation to be called later.
      */
     explicit vector (const size_type n, const allocator_type& a = allocator_type ()) :
-    _begin (_alloc.allocate(n)), _end (_begin + n), _alloc (a) {}
+    _begin (_alloc.allocate(n)), _end (_begin + n), _end_of_storage (_end), _alloc (a) {}
     
     explicit vector (const allocator_type& a = allocator_type ()) :
-    _begin (NULL), _end (NULL), _alloc (a) {}
+    _begin (NULL), _end (NULL), _end_of_storage (NULL), _alloc (a) {}
     
     /*
      * Destructor.
      * Deallocation only, no destuctors are called on the member objects.
      */
     ~vector () {
-        if (size() > 0)
-            _alloc.deallocate(_begin, size());
+        if (capacity() > 0)
+            _alloc.deallocate(_begin, capacity());
     }
     
     /*
      * Storage.
+     * The size can drop below the allocated capacity (e.g. after an in-place
+     * measurement), deallocation always happens on the full capacity.
      */
     inline void reserve (const size_type n) {
-        if (size() > 0) return;
+        if (capacity() > 0) return;
         _begin = _alloc.allocate(n);
         _end = _begin + n;
+        _end_of_storage = _end;
     }
     
     inline size_type size () const {
         return _end - _begin;
     }
     
+    inline size_type capacity () const {
+        return _end_of_storage - _begin;
+    }
+    
+    /*
+     * Change the size within the current capacity, no (de)allocation.
+     */
+    inline void resize (const size_type n) {
+        if (n > capacity())
+            throw std::length_error ("Cannot resize a vector beyond its capacity.");
+        _end = _begin + n;
+    }
+    
+    /*
+     * Move the elements to an allocation of exactly size() elements,
+     * releasing the unused capacity.
+     */
+    inline void shrink_to_fit () {
+        size_type n (size());
+        if (n == capacity()) return;
+        pointer p (_alloc.allocate(n));
+        std::copy(_begin, _end, p);
+        _alloc.deallocate(_begin, capacity());
+        _begin = p;
+        _end = p + n;
+        _end_of_storage = _end;
+    }
+    
+    /*
+     * Exchange storage with another vector, no elements are copied.
+     */
+    inline void swap (vector& other) {
+        std::swap(_begin, other._begin);
+        std::swap(_end, other._end);
+        std::swap(_end_of_storage, other._end_of_storage);
+        std::swap(_alloc, other._alloc);
+    }
+    
     inline allocator_type get_allocator () const {
         return _alloc;
     }
     
     inline void empty () {
-        if (size() == 0) return;
-        _alloc.deallocate(_begin, size());
+        if (capacity() == 0) return;
+        _alloc.deallocate(_begin, capacity());
         _begin = NULL;
         _end = NULL;
+        _end_of_storage = NULL;
     }
     
     inline void reset () {
         _begin = NULL;
         _end = NULL;
+        _end_of_storage = NULL;
     }
     
     /*